@@ -6,6 +6,7 @@
 
 #include "hardware.h"
 #include "a2r.h"
+#include "arena.h"
 
 struct a2r_header a2rheader;
 int a2r_is525=0; // Is the capture from a 5.25" disk in SS 40t 0.25 step
@@ -16,7 +17,7 @@ void a2r_processtiming(struct a2r_strm *stream, FILE *a2rfile, unsigned char *bu
 
   hw_samplerate=A2R_SAMPLE_RATE;
 
-  buff=malloc(stream->size);
+  buff=arena_borrow(ARENA_READSCRATCH, stream->size);
 
   if (buff!=NULL)
   {
@@ -27,7 +28,7 @@ void a2r_processtiming(struct a2r_strm *stream, FILE *a2rfile, unsigned char *bu
 
     if (fread(buff, stream->size, 1, a2rfile)==0)
     {
-      free(buff);
+      arena_release(ARENA_READSCRATCH, buff);
 
       return;
     }
@@ -59,7 +60,7 @@ void a2r_processtiming(struct a2r_strm *stream, FILE *a2rfile, unsigned char *bu
 //      printf("%d %.2fuS = %d\n", buff[i], (float)(buff[i])/8, bitgap);
     }
 
-    free(buff);
+    arena_release(ARENA_READSCRATCH, buff);
   }
   else
     fseek(a2rfile, stream->size, SEEK_CUR);
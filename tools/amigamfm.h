@@ -1,6 +1,10 @@
 #ifndef _AMIGAMFM_H_
 #define _AMIGAMFM_H_
 
+#include <stdint.h>
+
+#include "bucket.h"
+
 /*
 
 From : http://lclevy.free.fr/adflib/adf_info.html
@@ -108,9 +112,53 @@ A DD disk has 11*2*80=1760 (0 to 1759) blocks, a HD disk has 22*2*80=3520 blocks
 #define AMIGA_DATA_OFFSET 0x40
 
 #define AMIGA_MFM_MASK 0x55555555
+#define AMIGA_MFM_MASK64 0x5555555555555555ULL
+
+// Cells following the sync, packed 64 to a word, so each word holds two MFM longs
+#define AMIGA_SECTORCELLS ((AMIGA_SECTOR_SIZE-AMIGA_INFO_OFFSET)*8)
+#define AMIGA_SECTORWORDS (AMIGA_SECTORCELLS/64)
+
+// Word offsets within the packed sector, odd long in the upper half and even long in the lower
+#define AMIGA_INFO_WORD 0
+#define AMIGA_HEADER_CXSUM_WORD ((AMIGA_HEADER_CXSUM_OFFSET-AMIGA_INFO_OFFSET)/8)
+#define AMIGA_DATA_CXSUM_WORD ((AMIGA_DATA_CXSUM_OFFSET-AMIGA_INFO_OFFSET)/8)
+#define AMIGA_DATA_WORD ((AMIGA_DATA_OFFSET-AMIGA_INFO_OFFSET)/8)
+
+// Sync as the last 64 cells, 0xaaaa 0xaaaa 0x4489 0x4489 allowing for the pre-March 1990 encoding bug in the first bit
+#define AMIGA_SYNCMASK 0x7fffffffffffffffULL
+#define AMIGA_SYNC 0x2aaaaaaa44894489ULL
+
+typedef struct AmigaMFMContext
+{
+  // Physical position and speed the sample data was captured with
+  uint8_t track;
+  uint8_t head;
+  float rpm;
+
+  int state; // state machine
+  uint64_t cells; // 64 bit sliding buffer of the most recent cells, for spotting sync
+
+  unsigned long blockpos;
+
+  // Last known good sector header values
+  int lasttrack, lasthead, lastsector, lastlength;
+
+  // Cells of the sector following sync, plus a word for any overspill
+  uint64_t sectorcells[AMIGA_SECTORWORDS+1];
+  unsigned int sectorlen;
+
+  // MFM timings
+  float defaultwindow;
+  float bucket01, bucket001, bucket0001;
+  Bucket_Table buckets;
+
+  struct PLL *pll;
+
+  int debug;
+} AmigaMFM_Context;
 
-extern void amigamfm_addsample(const unsigned long samples, const unsigned long datapos, const int usepll);
+extern void amigamfm_addsample(AmigaMFM_Context *amigamfm, const unsigned long samples, const unsigned long datapos, const int usepll);
 
-extern void amigamfm_init(const int debug, const char density);
+extern void amigamfm_init(AmigaMFM_Context *amigamfm, const int debug, const char density, const uint8_t track, const uint8_t head, const float rpm);
 
 #endif
@@ -1,6 +1,10 @@
 #ifndef _APPLEGCR_H_
 #define _APPLEGCR_H_
 
+#include <stdint.h>
+
+#include "bucket.h"
+
 // State machine
 #define APPLEGCR_IDLE 0
 #define APPLEGCR_ID 1
@@ -15,11 +19,43 @@
 // Ideal bitcell width at 300 RPM
 #define APPLEGCR_BITCELL 4
 
-extern int applegcr_idamtrack, applegcr_idamsector;
-extern int applegcr_lasttrack, applegcr_lastsector;
+typedef struct AppleGCRContext
+{
+  // Physical position and speed the sample data was captured with
+  uint8_t track;
+  uint8_t head;
+  float rpm;
+
+  int state; // state machine
+  uint64_t datacells; // 64 bit sliding buffer, the most recent bits are in use and the rest are history
+  int bits; // Number of used bits within sliding buffer
+  float defaultwindow; // Number of samples in window
+  float threshold01; // Number of samples for an 01
+  float threshold001; // Number of samples for an 001
+  Bucket_Table buckets;
+
+  // Most recent address mark
+  unsigned long idpos, blockpos;
+  int idamtrack, idamsector; // IDAM values
+  int lasttrack, lastsector; // last known good IDAM values
+  unsigned int idblockcrc, datablockcrc;
+
+  unsigned int datamode;
+
+  unsigned char bytebuff[1024];
+  unsigned int bytelen;
+
+  unsigned char decodebuff[1024];
+
+  struct PLL *pll;
+
+  int debug;
+} AppleGCR_Context;
+
+extern void applegcr_buildgcrdecodemaps();
 
-extern void applegcr_addsample(const unsigned long samples, const unsigned long datapos, const int usepll);
+extern void applegcr_addsample(AppleGCR_Context *applegcr, const unsigned long samples, const unsigned long datapos, const int usepll);
 
-extern void applegcr_init(const int debug, const char density);
+extern void applegcr_init(AppleGCR_Context *applegcr, const int debug, const char density, const uint8_t track, const uint8_t head, const float rpm);
 
 #endif
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+// Single allocation holding all the buffers
+unsigned char *arena_base=NULL;
+unsigned long arena_size=0;
+
+// Size of each buffer, and the distance between them
+unsigned long arena_buffsize=0;
+unsigned long arena_stride=0;
+
+// Allocate all the buffers up front, so nothing needs allocating per track
+int arena_init(const unsigned long buffsize)
+{
+  void *base;
+
+  if (arena_base!=NULL)
+    arena_done();
+
+  arena_buffsize=buffsize;
+  arena_stride=((buffsize+ARENA_ALIGN-1)/ARENA_ALIGN)*ARENA_ALIGN;
+  arena_size=arena_stride*ARENA_BUFFERS;
+
+  if (posix_memalign(&base, ARENA_ALIGN, arena_size)!=0)
+  {
+    arena_size=0;
+    return 0;
+  }
+
+  arena_base=base;
+
+  // Touch every page now so there are no page faults whilst sampling
+  memset(arena_base, 0, arena_size);
+
+  // Try to keep it in memory, this needs privileges so carry on without if it fails
+  mlock(arena_base, arena_size);
+
+  return 1;
+}
+
+// Get one of the arena buffers
+unsigned char *arena_buffer(const int buffer)
+{
+  if ((arena_base==NULL) || (buffer<0) || (buffer>=ARENA_BUFFERS))
+    return NULL;
+
+  return &arena_base[arena_stride*buffer];
+}
+
+// Borrow an arena buffer as scratch space, allocating instead when it won't fit
+void *arena_borrow(const int buffer, const unsigned long size)
+{
+  if ((arena_base!=NULL) && (size<=arena_buffsize))
+    return arena_buffer(buffer);
+
+  return malloc(size);
+}
+
+// Finish with borrowed scratch space
+void arena_release(const int buffer, void *borrowed)
+{
+  if ((borrowed!=NULL) && (borrowed!=arena_buffer(buffer)))
+    free(borrowed);
+}
+
+// Free the arena
+void arena_done()
+{
+  if (arena_base==NULL)
+    return;
+
+  munlock(arena_base, arena_size);
+  free(arena_base);
+
+  arena_base=NULL;
+  arena_size=0;
+  arena_buffsize=0;
+  arena_stride=0;
+}
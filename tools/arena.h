@@ -0,0 +1,25 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include "capture.h"
+
+// Alignment of each buffer within the arena, to keep them cache line and page aligned
+#define ARENA_ALIGN 4096
+
+// Buffers held in the arena, each the size of a sample buffer
+#define ARENA_SAMPLE 0 // Sampling outside of the capture thread
+#define ARENA_CAPTURE 1 // Capture thread sampling, one per capture buffer
+#define ARENA_FLIPPY (ARENA_CAPTURE+CAPTURE_BUFFERS) // Flipped samples
+#define ARENA_WRITESCRATCH (ARENA_FLIPPY+1) // Encoding raw output
+#define ARENA_READSCRATCH (ARENA_WRITESCRATCH+1) // Decoding raw input
+#define ARENA_BUFFERS (ARENA_READSCRATCH+1)
+
+extern int arena_init(const unsigned long buffsize);
+extern unsigned char *arena_buffer(const int buffer);
+
+extern void *arena_borrow(const int buffer, const unsigned long size);
+extern void arena_release(const int buffer, void *borrowed);
+
+extern void arena_done();
+
+#endif
@@ -4,8 +4,12 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 #include "common.h"
+#include "arena.h"
+#include "capture.h"
 #include "hardware.h"
 #include "diskstore.h"
 #include "dfi.h"
@@ -18,14 +22,18 @@
 #include "atarist.h"
 #include "dfs.h"
 #include "dos.h"
+#include "drive.h"
 #include "fsd.h"
+#include "fusion.h"
 #include "teledisk.h"
 #include "rfi.h"
 #include "mod.h"
+#include "flux.h"
 #include "fm.h"
 #include "mfm.h"
 #include "gcr.h"
 #include "pll.h"
+#include "pool.h"
 
 // For type of capture
 #define DISKNONE 0
@@ -84,6 +92,9 @@ FILE *csvhandle=NULL;
 int sectorspertrack=AUTODETECT;
 int totalsectors=0;
 
+// Most sectors found on any track so far, used to decide when a track is complete
+unsigned char maxtracksectors=0;
+
 // Used for reversing bit order within a byte
 static unsigned char revlookup[16] = {0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe, 0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf};
 unsigned char reverse(unsigned char n)
@@ -92,39 +103,256 @@ unsigned char reverse(unsigned char n)
    return (revlookup[n&0x0f]<<4) | revlookup[n>>4];
 }
 
+// Reverse a raw sample buffer, as if read with the disk flipped over
+void flipsamples(unsigned char *flipped, const unsigned char *rawdata, const unsigned long rawlen)
+{
+  unsigned long em;
+
+  for (em=0; em<rawlen; em++)
+    flipped[rawlen-1-em]=reverse(rawdata[em]);
+}
+
 // Used for flipping the bits in a raw sample buffer
 void fillflippybuffer(const unsigned char *rawdata, const unsigned long rawlen)
 {
   if (flippybuffer==NULL)
-    flippybuffer=malloc(rawlen);
+    flippybuffer=arena_buffer(ARENA_FLIPPY);
 
   if (flippybuffer!=NULL)
+    flipsamples(flippybuffer, rawdata, rawlen);
+}
+
+// Determine if a sector has been read with a good CRC, rather than missing or only fused from bad copies
+int goodsector(const uint8_t track, const uint8_t head, const uint8_t sector)
+{
+  Disk_Sector *curr;
+
+  curr=diskstore_findhybridsector(track, head, sector);
+
+  return ((curr!=NULL) && (!curr->fused));
+}
+
+// Determine if all the expected sectors for a track have been found
+//   returns -1 when it can't be told yet, so it is checked again as more samples arrive
+int trackcomplete(const uint8_t track, const uint8_t head)
+{
+  int j;
+
+  // Sectors fused from bad copies don't count, so a retry can still read them with a good CRC
+  if (sectorspertrack!=AUTODETECT)
   {
-    unsigned long em;
+    for (j=0; j<sectorspertrack; j++)
+      if (!goodsector(track, head, j))
+        return 0;
 
-    for (em=0; em<rawlen; em++)
-      flippybuffer[rawlen-em]=reverse(rawdata[em]);
+    return 1;
   }
+
+  // Without a known format, don't trust a partial rotation as there may be more sectors to come
+  if (mod_context.datapos<(samplebuffsize/ROTATIONS))
+    return -1;
+
+  // Expect as many sectors as the fullest track so far, covering all the sector ids seen
+  if ((maxtracksectors==0) || (diskstore_countsectors(track, head)<maxtracksectors))
+    return 0;
+
+  for (j=diskstore_minsectorid; j<=diskstore_maxsectorid; j++)
+    if (!goodsector(track, head, j))
+      return 0;
+
+  return 1;
 }
 
-// Stop the motor and tidy up upon exit
-void exitFunction()
+// Demodulate a buffer as it is sampled, stopping the capture once the track is complete
+void streamtrack(Capture_Buffer *capbuff)
 {
-  printf("Exit function\n");
-  hw_done();
+  unsigned long available;
+  int complete;
+
+  // Use the first rotation to find the peaks
+  available=capture_wait(capbuff, samplebuffsize/ROTATIONS);
+  flux_start(&flux_list, capbuff->data);
+
+  // Index positions aren't known until sampling finishes
+  mod_setindexes(&mod_context, NULL, 0);
+  mod_setcompletecheck(&mod_context, trackcomplete);
+  mod_start(&mod_context, capbuff->data, samplebuffsize, available, capbuff->physical_track, capbuff->physical_head, capbuff->rpm, MOD_PASSBUCKET);
+
+  complete=mod_feed(&mod_context, available);
 
-  if (samplebuffer!=NULL)
+  while ((complete==0) && (available<samplebuffsize))
   {
-    free(samplebuffer);
-    samplebuffer=NULL;
+    unsigned long sampled;
+
+    sampled=capture_wait(capbuff, available+1);
+
+    // Sampling finished short of the buffer size
+    if (sampled==available)
+      break;
+
+    available=sampled;
+    complete=mod_feed(&mod_context, available);
   }
 
-  if (flippybuffer!=NULL)
+  if (complete)
+    capture_stop(capbuff);
+
+  // Index positions are known once sampling finishes
+  available=capture_finish(capbuff);
+  mod_setindexes(&mod_context, capbuff->indexes, capbuff->indexcount);
+
+  // Use the PLL on the whole buffer when buckets didn't find everything
+  if ((complete==0) && (usepll))
   {
-    free(flippybuffer);
-    flippybuffer=NULL;
+    mod_start(&mod_context, capbuff->data, available, available, capbuff->physical_track, capbuff->physical_head, capbuff->rpm, MOD_PASSPLL);
+    mod_feed(&mod_context, available);
   }
 
+  // Fuse bad copies from every rotation into any sectors still missing
+  if (complete==0)
+    fusion_recover(capbuff->physical_track, capbuff->physical_head);
+
+  // Place the sectors found within their rotations
+  diskstore_placesectors(&mod_context);
+}
+
+#ifdef NOPI
+// Number of threads decoding tracks at the same time
+unsigned int threads=1;
+
+// Every track/side to be decoded by the pool, along with where each was sampled
+Capture_Buffer *pooltracks=NULL;
+unsigned int poolsides;
+
+// Sample buffers and demodulation state for each pool worker
+unsigned char *poolsamples[POOL_MAXWORKERS];
+unsigned char *poolflippy[POOL_MAXWORKERS];
+Flux_List poolflux[POOL_MAXWORKERS];
+Mod_Context *poolcontexts[POOL_MAXWORKERS];
+
+// Only one track can be read from the sample file at a time
+pthread_mutex_t poolsamplelock=PTHREAD_MUTEX_INITIALIZER;
+
+// Sample and decode a single track/side on a pool worker
+void pooldecode(const unsigned int worker, const unsigned int job)
+{
+  Capture_Buffer *track=&pooltracks[job];
+  Mod_Context *context=poolcontexts[worker];
+  uint8_t lasttrack;
+
+  pthread_mutex_lock(&poolsamplelock);
+
+  lasttrack=hw_currenttrack;
+
+  drive_seek(track->track);
+  hw_sideselect(track->side);
+
+  // Wait for the drive to settle after seek/head select
+  if (hw_currenttrack!=lasttrack)
+    drive_settle(DRIVE_SETTLESTEP);
+  else
+    drive_settle(DRIVE_SETTLEHEAD);
+
+  track->physical_track=hw_currenttrack;
+  track->physical_head=hw_currenthead;
+  track->rpm=hw_rpm;
+
+  hw_samplerawtrackdata(poolsamples[worker], samplebuffsize);
+  track->filled=samplebuffsize;
+  capture_saveindexes(track);
+
+  pthread_mutex_unlock(&poolsamplelock);
+
+  if ((flippy==0) || (track->side==0))
+  {
+    mod_setindexes(context, track->indexes, track->indexcount);
+    mod_process(context, poolsamples[worker], samplebuffsize, track->physical_track, track->physical_head, track->rpm, 0, usepll);
+  }
+  else
+  {
+    // Flippy data is reversed, index positions aren't reversed so go unused
+    flipsamples(poolflippy[worker], poolsamples[worker], samplebuffsize);
+    mod_setindexes(context, NULL, 0);
+    mod_process(context, poolflippy[worker], samplebuffsize, track->physical_track, track->physical_head, track->rpm, 0, usepll);
+  }
+}
+
+// Free the pool worker buffers and demodulation state
+void pooldone()
+{
+  unsigned int worker;
+
+  for (worker=0; worker<POOL_MAXWORKERS; worker++)
+  {
+    free(poolsamples[worker]);
+    free(poolflippy[worker]);
+    free(poolcontexts[worker]);
+    flux_done(&poolflux[worker]);
+
+    poolsamples[worker]=NULL;
+    poolflippy[worker]=NULL;
+    poolcontexts[worker]=NULL;
+  }
+}
+
+// Sample and decode every track/side on a pool of threads, before the results are gone through in order
+//   returns 0 if there wasn't enough memory
+int pooldecodeall(const unsigned int tracks, const unsigned int firstside, const unsigned int sides)
+{
+  unsigned int worker, job;
+
+  pooltracks=calloc(tracks*sides, sizeof(Capture_Buffer));
+  if (pooltracks==NULL)
+    return 0;
+
+  poolsides=sides;
+
+  for (job=0; job<(tracks*sides); job++)
+  {
+    pooltracks[job].track=job/sides;
+    pooltracks[job].side=firstside+(job%sides);
+  }
+
+  for (worker=0; worker<threads; worker++)
+  {
+    poolsamples[worker]=malloc(samplebuffsize);
+    poolflippy[worker]=malloc(samplebuffsize);
+    poolcontexts[worker]=malloc(sizeof(Mod_Context));
+
+    if ((poolsamples[worker]==NULL) || (poolflippy[worker]==NULL) || (poolcontexts[worker]==NULL) ||
+        (!flux_init(&poolflux[worker], samplebuffsize)))
+    {
+      pooldone();
+      return 0;
+    }
+
+    mod_initcontext(poolcontexts[worker], &poolflux[worker]);
+  }
+
+  pool_run(threads, tracks*sides, pooldecode);
+
+  pooldone();
+
+  return 1;
+}
+#endif
+
+// Stop the motor and tidy up upon exit
+void exitFunction()
+{
+  printf("Exit function\n");
+
+  // Make sure the capture thread has finished with the drive
+  capture_done();
+
+  hw_done();
+
+  // Release sample buffers
+  arena_done();
+  flux_done(&flux_list);
+  samplebuffer=NULL;
+  flippybuffer=NULL;
+
   if (scp_trackoffsets!=NULL)
   {
     free(scp_trackoffsets);
@@ -147,9 +375,13 @@ void showargs(const char *exename)
   fprintf(stderr, "%s - Floppy disk raw flux capture and processor\n\n", exename);
   fprintf(stderr, "Syntax : ");
 #ifdef NOPI
-  fprintf(stderr, "[-i input_file] ");
+  fprintf(stderr, "[-i input_file] [-emulate] [-threads n] ");
 #endif
-  fprintf(stderr, "[-c] [[-ss [0|1]]|[-ds]] [-o output_file] [-spidiv spi_divider] [-r retries] [-sort] [-summary] [-l] [-sectors sectors_per_track] [-csv] [-tmax maxtracks] [-dblstep] [-title \"Title\"] [-v]\n");
+  fprintf(stderr, "[-c] [[-ss [0|1]]|[-ds]] [-o output_file] [-spidiv spi_divider] [-r retries] [-sort] [-summary] [-l] [-sectors sectors_per_track] [-csv] [-tmax maxtracks] [-dblstep] [-title \"Title\"] [-drive profile] [-settle fixed|adaptive] [-mod decoder] [-v]\n");
+  fprintf(stderr, "\nDrive profiles :\n");
+  drive_listprofiles(stderr);
+  fprintf(stderr, "\nDecoders :\n");
+  mod_listdecoders(stderr);
 }
 
 int main(int argc,char **argv)
@@ -166,6 +398,10 @@ int main(int argc,char **argv)
 #endif
   char *outputfilename=NULL;
   char title[100];
+  Capture_Buffer *capbuff;
+  const Mod_Decoders *probe;
+  unsigned int capturetracks, firstside, lastside;
+  struct timeval starttime, endtime;
 
   // Check we have some arguments
   if (argc==1)
@@ -366,6 +602,51 @@ int main(int argc,char **argv)
       }
     }
     else
+    if ((strcmp(argv[argn], "-drive")==0) && ((argn+1)<argc))
+    {
+      ++argn;
+
+      if (drive_setprofile(argv[argn]))
+        printf("Using %s drive profile\n", drive_profile->description);
+      else
+      {
+        fprintf(stderr, "Unknown drive profile\n");
+        return 8;
+      }
+    }
+    else
+    if ((strcmp(argv[argn], "-settle")==0) && ((argn+1)<argc))
+    {
+      ++argn;
+
+      if (strcmp(argv[argn], "fixed")==0)
+        drive_settlepolicy=DRIVE_SETTLEFIXED;
+      else
+      if (strcmp(argv[argn], "adaptive")==0)
+        drive_settlepolicy=DRIVE_SETTLEADAPTIVE;
+      else
+      {
+        fprintf(stderr, "Unknown settle policy\n");
+        return 8;
+      }
+    }
+    else
+    if ((strcmp(argv[argn], "-mod")==0) && ((argn+1)<argc))
+    {
+      ++argn;
+
+      if (mod_setdecoder(argv[argn]))
+      {
+        printf("Decoding with");
+        mod_showdecoders(stdout);
+      }
+      else
+      {
+        fprintf(stderr, "Unknown decoder\n");
+        return 8;
+      }
+    }
+    else
     if ((strcmp(argv[argn], "-spidiv")==0) && ((argn+1)<argc))
     {
       int retval;
@@ -562,6 +843,32 @@ int main(int argc,char **argv)
       samplefile=argv[argn];
 
     }
+    else
+    if (strcmp(argv[argn], "-emulate")==0)
+    {
+      printf("Emulating drive timings\n");
+
+      // Request emulation of real drive timings
+      hw_emulatetiming=1;
+    }
+    else
+    if ((strcmp(argv[argn], "-threads")==0) && ((argn+1)<argc))
+    {
+      int retval;
+
+      ++argn;
+
+      if ((sscanf(argv[argn], "%3d", &retval)==1) && (retval>=1) && (retval<=POOL_MAXWORKERS))
+      {
+        threads=retval;
+        printf("Decoding with up to %u threads\n", threads);
+      }
+      else
+      {
+        fprintf(stderr, "Number of threads must be from 1 to %d\n", POOL_MAXWORKERS);
+        return 1;
+      }
+    }
 #endif
 
     ++argn;
@@ -608,6 +915,7 @@ int main(int argc,char **argv)
   }
 
   diskstore_init(debug, usepll);
+  fusion_init(debug);
 
   mod_init(debug);
 
@@ -627,9 +935,11 @@ int main(int argc,char **argv)
   }
 #endif
 
-  // Allocate memory for SPI buffer
+  // Allocate memory for all the sample buffers up front
   samplebuffsize=((hw_samplerate/HW_ROTATIONSPERSEC)/BITSPERBYTE)*ROTATIONS;
-  samplebuffer=malloc(samplebuffsize);
+  if ((arena_init(samplebuffsize)) && (flux_init(&flux_list, samplebuffsize)))
+    samplebuffer=arena_buffer(ARENA_SAMPLE);
+
   if (samplebuffer==NULL)
   {
     fprintf(stderr, "\n");
@@ -666,7 +976,7 @@ int main(int argc,char **argv)
   hw_startmotor();
 
   // Wait for motor to get up to speed
-  hw_sleep(1);
+  drive_settle(DRIVE_SETTLEMOTOR);
 
   // Determine if head is at track 00
   if (hw_attrackzero())
@@ -690,7 +1000,7 @@ int main(int argc,char **argv)
   // Try to determine what type of disk is in what type of drive
 
   // Seek to track 2
-  hw_seektotrack(2);
+  drive_seek(2);
 
   if (sidetoread==AUTODETECT)
   {
@@ -700,30 +1010,35 @@ int main(int argc,char **argv)
   else
     hw_sideselect(sidetoread);
 
-  // Wait for a bit after seek to allow drive speed to settle
-  hw_sleep(1);
+  // Wait for the drive to settle after seek
+  drive_settle(DRIVE_SETTLESTEP);
 
   // Sample track
   hw_samplerawtrackdata(samplebuffer, samplebuffsize);
-  mod_process(samplebuffer, samplebuffsize, 99, usepll);
+  mod_setindexes(&mod_context, hw_indexpos, hw_indexcount);
+  mod_process(&mod_context, samplebuffer, samplebuffsize, hw_currenttrack, hw_currenthead, hw_rpm, 99, usepll);
+
+  // Sector IDs last seen by each decoder, as found by the PLL when it is in use
+  probe=(usepll?&mod_context.pll:&mod_context.bucket);
 
   // Check readability
-  if ((fm_lasttrack==-1) && (fm_lasthead==-1) && (fm_lastsector==-1) && (fm_lastlength==-1))
+  if ((probe->fm.lasttrack==-1) && (probe->fm.lasthead==-1) && (probe->fm.lastsector==-1) && (probe->fm.lastlength==-1))
     printf("No FM sector IDs found\n");
   else
     modulation=MODFM;
 
-  if ((mfm_lasttrack==-1) && (mfm_lasthead==-1) && (mfm_lastsector==-1) && (mfm_lastlength==-1))
+  if ((probe->mfm.lasttrack==-1) && (probe->mfm.lasthead==-1) && (probe->mfm.lastsector==-1) && (probe->mfm.lastlength==-1)
+     && (probe->amigamfm.lasttrack==-1) && (probe->amigamfm.lasthead==-1) && (probe->amigamfm.lastsector==-1) && (probe->amigamfm.lastlength==-1))
     printf("No MFM sector IDs found\n");
   else
     modulation=MODMFM;
 
-  if ((gcr_lasttrack==-1) && (gcr_lastsector==-1))
+  if ((probe->gcr.lasttrack==-1) && (probe->gcr.lastsector==-1))
     printf("No C64 GCR sector IDs found\n");
   else
     modulation=MODGCR;
 
-  if ((applegcr_lasttrack==-1) && (applegcr_lastsector==-1))
+  if ((probe->applegcr.lasttrack==-1) && (probe->applegcr.lastsector==-1))
     printf("No Apple GCR sector IDs found\n");
   else
     modulation=MODAPPLEGCR;
@@ -735,33 +1050,41 @@ int main(int argc,char **argv)
     int othersector=-1;
 
     // Check if it was FM sectors found
-    if ((fm_lasttrack!=-1) && (fm_lasthead!=-1) && (fm_lastsector!=-1) && (fm_lastlength!=-1))
+    if ((probe->fm.lasttrack!=-1) && (probe->fm.lasthead!=-1) && (probe->fm.lastsector!=-1) && (probe->fm.lastlength!=-1))
     {
-      othertrack=fm_lasttrack;
-      otherhead=fm_lasthead;
-      othersector=fm_lastsector;
+      othertrack=probe->fm.lasttrack;
+      otherhead=probe->fm.lasthead;
+      othersector=probe->fm.lastsector;
     }
 
     // Check if it was MFM sectors found
-    if ((mfm_lasttrack!=-1) && (mfm_lasthead!=-1) && (mfm_lastsector!=-1) && (mfm_lastlength!=-1))
+    if ((probe->mfm.lasttrack!=-1) && (probe->mfm.lasthead!=-1) && (probe->mfm.lastsector!=-1) && (probe->mfm.lastlength!=-1))
+    {
+      othertrack=probe->mfm.lasttrack;
+      otherhead=probe->mfm.lasthead;
+      othersector=probe->mfm.lastsector;
+    }
+
+    // Check if it was Amiga MFM sectors found
+    if ((probe->amigamfm.lasttrack!=-1) && (probe->amigamfm.lasthead!=-1) && (probe->amigamfm.lastsector!=-1) && (probe->amigamfm.lastlength!=-1))
     {
-      othertrack=mfm_lasttrack;
-      otherhead=mfm_lasthead;
-      othersector=mfm_lastsector;
+      othertrack=probe->amigamfm.lasttrack;
+      otherhead=probe->amigamfm.lasthead;
+      othersector=probe->amigamfm.lastsector;
     }
 
     // Check if it was C64 GCR sectors found
-    if ((gcr_lasttrack!=-1) && (gcr_lastsector!=-1))
+    if ((probe->gcr.lasttrack!=-1) && (probe->gcr.lastsector!=-1))
     {
-      othertrack=gcr_lasttrack;
-      othersector=gcr_lastsector;
+      othertrack=probe->gcr.lasttrack;
+      othersector=probe->gcr.lastsector;
     }
 
     // Check if it was Apple GCR sectors found
-    if ((applegcr_lasttrack!=-1) && (applegcr_lastsector!=-1))
+    if ((probe->applegcr.lasttrack!=-1) && (probe->applegcr.lastsector!=-1))
     {
-      othertrack=applegcr_lasttrack;
-      othersector=applegcr_lastsector;
+      othertrack=probe->applegcr.lasttrack;
+      othersector=probe->applegcr.lastsector;
     }
 
     // Only look for data on other side if user hasn't specified number of sides to capture
@@ -770,28 +1093,32 @@ int main(int argc,char **argv)
       // Select upper side
       hw_sideselect(1);
 
-      // Wait for a bit after head switch to allow drive to settle
-      hw_sleep(1);
+      // Wait for the drive to settle after head switch
+      drive_settle(DRIVE_SETTLEHEAD);
 
       // Sample track
       hw_samplerawtrackdata(samplebuffer, samplebuffsize);
-      mod_process(samplebuffer, samplebuffsize, 99, usepll);
+      mod_setindexes(&mod_context, hw_indexpos, hw_indexcount);
+      mod_process(&mod_context, samplebuffer, samplebuffsize, hw_currenttrack, hw_currenthead, hw_rpm, 99, usepll);
 
       // Check for flippy disk
-      if ((fm_lasttrack==-1) && (fm_lasthead==-1) && (fm_lastsector==-1) && (fm_lastlength==-1)
-         && (mfm_lasttrack==-1) && (mfm_lasthead==-1) && (mfm_lastsector==-1) && (mfm_lastlength==-1)
-         && (gcr_lasttrack==-1) && (gcr_lastsector==-1)
-         && (applegcr_lasttrack==-1) && (applegcr_lastsector==-1))
+      if ((probe->fm.lasttrack==-1) && (probe->fm.lasthead==-1) && (probe->fm.lastsector==-1) && (probe->fm.lastlength==-1)
+         && (probe->mfm.lasttrack==-1) && (probe->mfm.lasthead==-1) && (probe->mfm.lastsector==-1) && (probe->mfm.lastlength==-1)
+         && (probe->amigamfm.lasttrack==-1) && (probe->amigamfm.lasthead==-1) && (probe->amigamfm.lastsector==-1) && (probe->amigamfm.lastlength==-1)
+         && (probe->gcr.lasttrack==-1) && (probe->gcr.lastsector==-1)
+         && (probe->applegcr.lasttrack==-1) && (probe->applegcr.lastsector==-1))
       {
         fillflippybuffer(samplebuffer, samplebuffsize);
+        mod_setindexes(&mod_context, NULL, 0);
 
         if (flippybuffer!=NULL)
-          mod_process(flippybuffer, samplebuffsize, 99, usepll);
+          mod_process(&mod_context, flippybuffer, samplebuffsize, hw_currenttrack, hw_currenthead, hw_rpm, 99, usepll);
 
-        if ((fm_lasttrack!=-1) || (fm_lasthead!=-1) || (fm_lastsector!=-1) || (fm_lastlength!=-1)
-           || (mfm_lasttrack!=-1) || (mfm_lasthead!=-1) || (mfm_lastsector!=-1) || (mfm_lastlength!=-1)
-           || (gcr_lasttrack!=-1) || (gcr_lastsector!=-1)
-           || (applegcr_lasttrack!=-1) || (applegcr_lastsector!=-1))
+        if ((probe->fm.lasttrack!=-1) || (probe->fm.lasthead!=-1) || (probe->fm.lastsector!=-1) || (probe->fm.lastlength!=-1)
+           || (probe->mfm.lasttrack!=-1) || (probe->mfm.lasthead!=-1) || (probe->mfm.lastsector!=-1) || (probe->mfm.lastlength!=-1)
+           || (probe->amigamfm.lasttrack!=-1) || (probe->amigamfm.lasthead!=-1) || (probe->amigamfm.lastsector!=-1) || (probe->amigamfm.lastlength!=-1)
+           || (probe->gcr.lasttrack!=-1) || (probe->gcr.lastsector!=-1)
+           || (probe->applegcr.lasttrack!=-1) || (probe->applegcr.lastsector!=-1))
         {
           printf("Flippy disk detected\n");
           flippy=1;
@@ -799,10 +1126,11 @@ int main(int argc,char **argv)
       }
 
       // Check readability
-      if ((fm_lasttrack==-1) && (fm_lasthead==-1) && (fm_lastsector==-1) && (fm_lastlength==-1)
-         && (mfm_lasttrack==-1) && (mfm_lasthead==-1) && (mfm_lastsector==-1) && (mfm_lastlength==-1)
-         && (gcr_lasttrack==-1) && (gcr_lastsector==-1)
-         && (applegcr_lasttrack==-1) && (applegcr_lastsector==-1))
+      if ((probe->fm.lasttrack==-1) && (probe->fm.lasthead==-1) && (probe->fm.lastsector==-1) && (probe->fm.lastlength==-1)
+         && (probe->mfm.lasttrack==-1) && (probe->mfm.lasthead==-1) && (probe->mfm.lastsector==-1) && (probe->mfm.lastlength==-1)
+         && (probe->amigamfm.lasttrack==-1) && (probe->amigamfm.lasthead==-1) && (probe->amigamfm.lastsector==-1) && (probe->amigamfm.lastlength==-1)
+         && (probe->gcr.lasttrack==-1) && (probe->gcr.lastsector==-1)
+         && (probe->applegcr.lasttrack==-1) && (probe->applegcr.lastsector==-1))
       {
         // Only lower side was readable
         printf("Single-sided disk assumed, only found data on side 0\n");
@@ -812,7 +1140,7 @@ int main(int argc,char **argv)
       else
       {
         // If IDAM shows same head, then double-sided separate
-        if ((fm_lasthead==otherhead) || (mfm_lasthead==otherhead))
+        if ((probe->fm.lasthead==otherhead) || (probe->mfm.lasthead==otherhead) || (probe->amigamfm.lasthead==otherhead))
           printf("Double-sided with separate sides disk detected\n");
         else
           printf("Double-sided disk detected\n");
@@ -870,6 +1198,13 @@ int main(int argc,char **argv)
     sides=2;
   }
 
+  // Only run the decoders which found sector IDs whilst autodetecting
+  if (mod_selectfound())
+  {
+    printf("Decoding with");
+    mod_showdecoders(stdout);
+  }
+
   // Write header when doing raw capture
   if (capturetype==DISKRAW)
   {
@@ -895,49 +1230,124 @@ int main(int argc,char **argv)
     fflush(rawdata);
   }
 
+  gettimeofday(&starttime, NULL);
+
   // Start at track 0
-  hw_seektotrackzero();
+  drive_seek(0);
 
-  // Loop through the tracks
-  for (i=0; i<(drivetracks/hw_stepping); i++)
+  // When only doing a catalogue, or this is an 80 track disk in a 40 track drive, don't go any further than the first track
+  if ((capturetype==DISKCAT) || ((drivetracks==40) && (disktracks==80)))
+    capturetracks=1;
+  else
+    capturetracks=(drivetracks/hw_stepping);
+
+  // Read the specified side if in single side read mode
+  if ((sides==1) && (sidetoread!=AUTODETECT))
+    firstside=sidetoread;
+  else
+    firstside=0;
+
+  lastside=firstside+(sides-1);
+
+#ifdef NOPI
+  // Decode all the tracks up front on several threads, verbose output is kept in order by not doing so
+  if ((threads>1) && (capturetype==DISKIMG) && (debug==0))
   {
-    hw_seektotrack(i);
+    if (!pooldecodeall(capturetracks, firstside, sides))
+    {
+      fprintf(stderr, "Failed to start decoding threads\n");
+      return 3;
+    }
+  }
+  else
+#endif
+  {
+    // Start the capture thread, so the next track is sampled whilst this one is processed
+    if (!capture_init(samplebuffsize, (capturetype==DISKRAW)))
+    {
+      fprintf(stderr, "Failed to start capture\n");
+      return 3;
+    }
 
+    capture_request(0, firstside);
+  }
+
+  // Loop through the tracks
+  for (i=0; i<capturetracks; i++)
+  {
     // Process all available disk sides (heads)
-    for (side=0; side<sides; side++)
+    for (side=firstside; side<=lastside; side++)
     {
-      // Read the specified side if in single side read mode
-      if ((sides==1) && (sidetoread!=AUTODETECT))
-        side=sidetoread;
+#ifdef NOPI
+      // Already sampled and decoded
+      if (pooltracks!=NULL)
+        capbuff=&pooltracks[(i*poolsides)+(side-firstside)];
+      else
+#endif
+      {
+        // Wait for this track/side to be sampled
+        capbuff=capture_collect();
+        if (capbuff==NULL)
+          break;
 
-      // Select the correct side
-      hw_sideselect(side);
+        // Start sampling the next track/side
+        if (side<lastside)
+          capture_request(i, side+1);
+        else
+        if ((i+1)<capturetracks)
+          capture_request(i+1, firstside);
+      }
+
+      printf("Sampling data for track %.2X head %.2x\n", i, side);
 
       // Retry the capture if any sectors are missing
       for (retry=0; retry<retries; retry++)
       {
-        // Wait for a bit after seek/head select to allow drive speed to settle
-        hw_sleep(1);
+        if (retry>0)
+        {
+          // Wait for the capture thread to finish with the drive before going back to this track
+          capture_idle();
 
-        if (retry==0)
-          printf("Sampling data for track %.2X head %.2x\n", i, side);
+          drive_seek(i);
+          hw_sideselect(side);
 
-        // Sampling data
-        hw_samplerawtrackdata(samplebuffer, samplebuffsize);
+          // Wait for the drive to settle after seek/head select
+          drive_settle(DRIVE_SETTLESTEP);
+
+          // Sampling data
+          hw_samplerawtrackdata(capbuff->data, samplebuffsize);
+          capture_saveindexes(capbuff);
+        }
 
         // Process the raw sample data to extract encoded data
         if (capturetype!=DISKRAW)
         {
+#ifdef NOPI
+          if (pooltracks!=NULL)
+            break;
+#endif
+
           if ((flippy==0) || (side==0))
           {
-            mod_process(samplebuffer, samplebuffsize, retry, usepll);
+            if (retry==0)
+            {
+              streamtrack(capbuff);
+            }
+            else
+            {
+              mod_setindexes(&mod_context, capbuff->indexes, capbuff->indexcount);
+              mod_process(&mod_context, capbuff->data, samplebuffsize, capbuff->physical_track, capbuff->physical_head, capbuff->rpm, retry, usepll);
+            }
           }
           else
           {
-            fillflippybuffer(samplebuffer, samplebuffsize);
+            // Flippy data is reversed so needs the whole buffer, index positions aren't reversed so go unused
+            capture_finish(capbuff);
+            fillflippybuffer(capbuff->data, samplebuffsize);
+            mod_setindexes(&mod_context, NULL, 0);
 
             if (flippybuffer!=NULL)
-              mod_process(flippybuffer, samplebuffsize, retry, usepll);
+              mod_process(&mod_context, flippybuffer, samplebuffsize, capbuff->physical_track, capbuff->physical_head, capbuff->rpm, retry, usepll);
           }
 
 #ifdef NOPI
@@ -955,7 +1365,7 @@ int main(int argc,char **argv)
 
           for (j=0; j<sectorspertrack; j++)
 	  {
-            if (diskstore_findhybridsector(hw_currenttrack, hw_currenthead, j)==NULL)
+            if (!goodsector(capbuff->physical_track, capbuff->physical_head, j))
 	    {
               // Failed to read at least one track
               trackstatus=0;
@@ -966,7 +1376,7 @@ int main(int argc,char **argv)
 
           printf("Retry attempt %d, sectors ", retry+1);
           for (j=0; j<sectorspertrack; j++)
-            if (diskstore_findhybridsector(hw_currenttrack, hw_currenthead, j)==NULL) printf("%.2u ", j);
+            if (!goodsector(capbuff->physical_track, capbuff->physical_head, j)) printf("%.2u ", j);
           printf("\n");
         }
         else
@@ -978,10 +1388,13 @@ int main(int argc,char **argv)
         // Check if catalogue has been done
         if ((info<sides) && (catalogue==1))
         {
-          if (dfs_validcatalogue(hw_currenthead, &totalsectors))
+          // Catalogue may need to read further tracks from the drive
+          capture_idle();
+
+          if (dfs_validcatalogue(capbuff->physical_head, &totalsectors))
           {
-            printf("\nDetected DFS, side : %d\n", hw_currenthead);
-            dfs_showinfo(hw_currenthead, disktracks, sectorspertrack==-1?DFS_SECTORSPERTRACK:sectorspertrack);
+            printf("\nDetected DFS, side : %d\n", capbuff->physical_head);
+            dfs_showinfo(capbuff->physical_head, disktracks, sectorspertrack==-1?DFS_SECTORSPERTRACK:sectorspertrack);
             info++;
             printf("\n");
           }
@@ -1084,28 +1497,38 @@ int main(int argc,char **argv)
         }
 
         if (retry>=retries)
-          printf("I/O error reading head %d track %u\n", hw_currenthead, i);
+          printf("I/O error reading head %d track %u\n", capbuff->physical_head, i);
+
+        if (diskstore_countsectors(capbuff->physical_track, capbuff->physical_head)>maxtracksectors)
+          maxtracksectors=diskstore_countsectors(capbuff->physical_track, capbuff->physical_head);
       }
       else
       {
+        // Raw data is always written for all rotations, along with the speed and index positions
+        capture_finish(capbuff);
+
         // Write the raw sample data if required
         if (rawdata!=NULL)
         {
-          unsigned char *rawbuffer=samplebuffer;
+          unsigned char *rawbuffer=capbuff->data;
+          unsigned int indexcount=capbuff->indexcount;
 
           // Handle flippy data
           if ((flippy==1) && (side==1))
           {
-            fillflippybuffer(samplebuffer, samplebuffsize);
+            fillflippybuffer(capbuff->data, samplebuffsize);
 
             if (flippybuffer!=NULL)
+            {
               rawbuffer=flippybuffer;
+              indexcount=0;
+            }
           }
 
           switch (outputtype)
           {
             case IMAGERAW:
-              rfi_writetrack(rawdata, i, side, hw_measurerpm(), "rle", samplebuffer, samplebuffsize);
+              rfi_writetrack(rawdata, i, side, capbuff->rpm, "rle", capbuff->data, samplebuffsize);
               break;
 
             case IMAGEDFI:
@@ -1113,7 +1536,7 @@ int main(int argc,char **argv)
               break;
 
             case IMAGESCP:
-              scp_writetrack(rawdata, ((i/hw_stepping)*sides)+side, rawbuffer, samplebuffsize, ROTATIONS, hw_measurerpm());
+              scp_writetrack(rawdata, ((i/hw_stepping)*sides)+side, rawbuffer, samplebuffsize, ROTATIONS, capbuff->indexes, indexcount, capbuff->rpm);
               break;
 
             default:
@@ -1125,18 +1548,20 @@ int main(int argc,char **argv)
         fflush(rawdata);
       }
     } // side loop
+  } // track loop
 
-    // If we're only doing a catalogue, then don't read any more tracks
-    if (capturetype==DISKCAT)
-      break;
+  // Stop the capture thread before using the drive directly
+  capture_done();
 
-    // If this is an 80 track disk in a 40 track drive, then don't go any further
-    if ((drivetracks==40) && (disktracks==80))
-      break;
-  } // track loop
+#ifdef NOPI
+  free(pooltracks);
+  pooltracks=NULL;
+#endif
 
   // Return the disk head to track 0 following disk imaging
-  hw_seektotrackzero();
+  drive_seek(0);
+
+  gettimeofday(&endtime, NULL);
 
   printf("Finished\n");
 
@@ -1314,19 +1739,11 @@ int main(int argc,char **argv)
   if (diskimage!=NULL) fclose(diskimage);
   if (rawdata!=NULL) fclose(rawdata);
 
-  // Free memory allocated to SPI buffer
-  if (samplebuffer!=NULL)
-  {
-    free(samplebuffer);
-    samplebuffer=NULL;
-  }
-
-  // Free any memory allocated to flippy buffer
-  if (flippybuffer!=NULL)
-  {
-    free(flippybuffer);
-    flippybuffer=NULL;
-  }
+  // Free memory allocated to sample buffers
+  arena_done();
+  flux_done(&flux_list);
+  samplebuffer=NULL;
+  flippybuffer=NULL;
 
   // When writing csv, close file (if open)
   if((csv) && (csvhandle!=NULL))
@@ -1352,6 +1769,16 @@ int main(int argc,char **argv)
 
     printf("Drive tracks %d\n", drivetracks);
 
+    printf("Imaging took %.2f seconds\n", (float)(endtime.tv_sec-starttime.tv_sec)+((float)(endtime.tv_usec-starttime.tv_usec)/USINSECOND));
+    // Sample files are only read with drive timings when emulating, otherwise there's nothing saved
+#ifdef NOPI
+    if (hw_emulatetiming)
+#endif
+    {
+      printf("Settling took %.2f seconds, saving %.2f seconds over fixed settling\n", drive_settleseconds(), drive_settlesaved());
+      printf("Seeking %lu steps took %.2f seconds, saving %.2f seconds over %dms steps\n", drive_seeksteps(), drive_seekseconds(), drive_seeksaved(), HW_MAXSTEPRATE);
+    }
+
     if (sides==1)
       printf("Single sided capture\n");
     else
@@ -1361,6 +1788,7 @@ int main(int argc,char **argv)
     if (mfmsectors!=0) printf("MFM sectors found %u\n", mfmsectors);
     if (gcrsectors!=0) printf("GCR sectors found %u\n", gcrsectors);
     if (applegcrsectors!=0) printf("Apple GCR sectors found %u\n", applegcrsectors);
+    if (fusion_recovered!=0) printf("Sectors recovered by fusing bad copies %u\n", fusion_recovered);
 
     printf("Detected density : ");
     if ((mod_density&MOD_DENSITYFMSD)!=0) printf("SD ");
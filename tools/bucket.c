@@ -0,0 +1,43 @@
+#include "bucket.h"
+
+// Number of cells for an interval, by comparing against each limit in turn
+unsigned int bucket_cells(const Bucket_Table *table, const unsigned long samples)
+{
+  unsigned int bucket;
+
+  for (bucket=0; bucket<table->limitcount; bucket++)
+    if (samples<=table->limits[bucket])
+      break;
+
+  return table->firstcells+bucket;
+}
+
+// Fill in the table from the bucket limits, the first bucket holding firstcells cells and each one after it another cell
+//   it's only rebuilt when the limits change, such as for a different density, speed or zone
+void bucket_build(Bucket_Table *table, const float *limits, const unsigned int limitcount, const unsigned int firstcells)
+{
+  unsigned int i;
+  unsigned long samples;
+
+  if ((limitcount==0) || (limitcount>BUCKET_MAXLIMITS))
+    return;
+
+  if ((table->limitcount==limitcount) && (table->firstcells==firstcells))
+  {
+    for (i=0; i<limitcount; i++)
+      if (table->limits[i]!=limits[i])
+        break;
+
+    if (i==limitcount)
+      return;
+  }
+
+  for (i=0; i<limitcount; i++)
+    table->limits[i]=limits[i];
+
+  table->limitcount=limitcount;
+  table->firstcells=firstcells;
+
+  for (samples=0; samples<BUCKET_TABLESIZE; samples++)
+    table->cells[samples]=bucket_cells(table, samples);
+}
@@ -0,0 +1,27 @@
+#ifndef _BUCKET_H_
+#define _BUCKET_H_
+
+// Intervals looked up directly, matching the range of the histogram, longer ones are compared against the limits
+#define BUCKET_TABLESIZE 512
+
+// Maximum number of bucket limits, the last bucket has no upper limit
+#define BUCKET_MAXLIMITS 4
+
+// Number of cells up to and including the "1" for each interval length, for decoders which bucket intervals
+typedef struct BucketTable
+{
+  // Inclusive upper limit in samples of each bucket, as the table was last built from
+  float limits[BUCKET_MAXLIMITS];
+  unsigned int limitcount;
+  unsigned int firstcells;
+
+  unsigned char cells[BUCKET_TABLESIZE];
+} Bucket_Table;
+
+// Number of cells for an interval, from the table where possible
+#define BUCKET_CELLS(table, samples) (((samples)<BUCKET_TABLESIZE)?(table)->cells[(samples)]:bucket_cells((table), (samples)))
+
+extern void bucket_build(Bucket_Table *table, const float *limits, const unsigned int limitcount, const unsigned int firstcells);
+extern unsigned int bucket_cells(const Bucket_Table *table, const unsigned long samples);
+
+#endif
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+
+#include "hardware.h"
+#include "capture.h"
+#include "drive.h"
+#include "arena.h"
+
+Capture_Buffer capture_buffers[CAPTURE_BUFFERS];
+
+// Signalled once per request queued for the capture thread
+sem_t capture_queued;
+
+// Signalled when sampling starts into each buffer
+sem_t capture_ready[CAPTURE_BUFFERS];
+
+pthread_t capture_thread;
+int capture_running=0;
+int capture_measurerpm=0;
+unsigned long capture_buffsize=0;
+
+// Next buffers to be requested and collected, only used by the processing thread
+unsigned int capture_requestslot=0;
+unsigned int capture_collectslot=0;
+Capture_Buffer *capture_current=NULL;
+
+// Keep the index pulse positions from the last sampling
+void capture_saveindexes(Capture_Buffer *buff)
+{
+  unsigned int i;
+
+  for (i=0; i<hw_indexcount; i++)
+    buff->indexes[i]=hw_indexpos[i];
+
+  buff->indexcount=hw_indexcount;
+}
+
+// Capture thread, seeks and samples each requested track in turn
+void *capture_worker(void *arg)
+{
+  unsigned int slot=0;
+  (void) arg;
+
+  while (1)
+  {
+    Capture_Buffer *buff;
+    uint8_t lasttrack;
+
+    // Wait for the next request
+    sem_wait(&capture_queued);
+
+    if (__atomic_load_n(&capture_running, __ATOMIC_ACQUIRE)==0)
+      break;
+
+    buff=&capture_buffers[slot];
+
+    lasttrack=hw_currenttrack;
+
+    drive_seek(buff->track);
+    hw_sideselect(buff->side);
+
+    // Wait for the drive to settle after seek/head select
+    if (hw_currenttrack!=lasttrack)
+      drive_settle(DRIVE_SETTLESTEP);
+    else
+      drive_settle(DRIVE_SETTLEHEAD);
+
+    buff->physical_track=hw_currenttrack;
+    buff->physical_head=hw_currenthead;
+    buff->rpm=hw_rpm;
+    buff->filled=0;
+    buff->stop=0;
+    buff->indexcount=0;
+
+    // Hand the buffer over to the processing thread as it is sampled, not showing progress from the last one
+    __atomic_store_n(&hw_sampledbytes, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&buff->state, CAPTURE_SAMPLING, __ATOMIC_SEQ_CST);
+    sem_post(&capture_ready[slot]);
+
+    // Sampling data
+    hw_samplestop=&buff->stop;
+    hw_samplerawtrackdata(buff->data, capture_buffsize);
+    hw_samplestop=NULL;
+
+    buff->filled=__atomic_load_n(&hw_sampledbytes, __ATOMIC_ACQUIRE);
+    capture_saveindexes(buff);
+
+    // Use the index pulses seen whilst sampling to determine the speed
+    if (capture_measurerpm)
+    {
+      buff->rpm=hw_indexrpm(buff->indexes, buff->indexcount);
+
+      if (buff->rpm>0)
+        hw_rpm=buff->rpm;
+      else
+        buff->rpm=hw_measurerpm();
+    }
+
+    __atomic_store_n(&buff->state, CAPTURE_FULL, __ATOMIC_RELEASE);
+
+    slot=(slot+1)%CAPTURE_BUFFERS;
+  }
+
+  return NULL;
+}
+
+// Queue a track/side to be captured in the background
+void capture_request(const int track, const int side)
+{
+  Capture_Buffer *buff;
+
+  buff=&capture_buffers[capture_requestslot];
+
+  // Check the buffer isn't still waiting to be processed
+  if (__atomic_load_n(&buff->state, __ATOMIC_ACQUIRE)!=CAPTURE_FREE)
+    return;
+
+  buff->track=track;
+  buff->side=side;
+
+  __atomic_store_n(&buff->state, CAPTURE_QUEUED, __ATOMIC_RELEASE);
+  sem_post(&capture_queued);
+
+  capture_requestslot=(capture_requestslot+1)%CAPTURE_BUFFERS;
+}
+
+// Sleep between checks on the capture thread
+void capture_poll()
+{
+  struct timespec ts;
+
+  ts.tv_sec=0;
+  ts.tv_nsec=CAPTURE_POLLUS*1000;
+
+  nanosleep(&ts, NULL);
+}
+
+// Wait for sampling of the next requested track/side to start, the previously collected buffer is released
+Capture_Buffer *capture_collect()
+{
+  Capture_Buffer *buff;
+
+  if (capture_current!=NULL)
+  {
+    // Sampling may still be finishing after being stopped early
+    while (__atomic_load_n(&capture_current->state, __ATOMIC_ACQUIRE)!=CAPTURE_FULL)
+      capture_poll();
+
+    __atomic_store_n(&capture_current->state, CAPTURE_FREE, __ATOMIC_RELEASE);
+    capture_current=NULL;
+  }
+
+  buff=&capture_buffers[capture_collectslot];
+
+  // Nothing has been requested
+  if (__atomic_load_n(&buff->state, __ATOMIC_ACQUIRE)==CAPTURE_FREE)
+    return NULL;
+
+  sem_wait(&capture_ready[capture_collectslot]);
+
+  capture_collectslot=(capture_collectslot+1)%CAPTURE_BUFFERS;
+  capture_current=buff;
+
+  return buff;
+}
+
+// Wait until at least the needed amount of a buffer has been sampled, or sampling has finished
+unsigned long capture_wait(Capture_Buffer *buff, const unsigned long needed)
+{
+  unsigned long available;
+
+  while (1)
+  {
+    if (__atomic_load_n(&buff->state, __ATOMIC_SEQ_CST)==CAPTURE_FULL)
+      return buff->filled;
+
+    available=__atomic_load_n(&hw_sampledbytes, __ATOMIC_SEQ_CST);
+
+    // Only trust progress if this buffer was still being sampled after reading it
+    if ((__atomic_load_n(&buff->state, __ATOMIC_SEQ_CST)==CAPTURE_SAMPLING) && (available>=needed))
+      return available;
+
+    capture_poll();
+  }
+}
+
+// Wait until sampling into a buffer has finished, along with the index positions and speed
+unsigned long capture_finish(Capture_Buffer *buff)
+{
+  while (__atomic_load_n(&buff->state, __ATOMIC_ACQUIRE)!=CAPTURE_FULL)
+    capture_poll();
+
+  return buff->filled;
+}
+
+// Request sampling into a buffer finishes early
+void capture_stop(Capture_Buffer *buff)
+{
+  __atomic_store_n(&buff->stop, 1, __ATOMIC_RELEASE);
+}
+
+// Wait for the capture thread to finish with the drive, without collecting anything
+void capture_idle()
+{
+  unsigned int slot;
+
+  if (capture_running==0)
+    return;
+
+  for (slot=0; slot<CAPTURE_BUFFERS; slot++)
+  {
+    while ((__atomic_load_n(&capture_buffers[slot].state, __ATOMIC_ACQUIRE)==CAPTURE_QUEUED) ||
+           (__atomic_load_n(&capture_buffers[slot].state, __ATOMIC_ACQUIRE)==CAPTURE_SAMPLING))
+      capture_poll();
+  }
+}
+
+// Stop the capture thread and release buffers
+void capture_done()
+{
+  unsigned int slot;
+
+  if (capture_running==0)
+    return;
+
+  // Let any capture in progress complete, then stop the thread
+  __atomic_store_n(&capture_running, 0, __ATOMIC_RELEASE);
+  sem_post(&capture_queued);
+  pthread_join(capture_thread, NULL);
+
+  for (slot=0; slot<CAPTURE_BUFFERS; slot++)
+  {
+    capture_buffers[slot].data=NULL;
+
+    sem_destroy(&capture_ready[slot]);
+  }
+
+  sem_destroy(&capture_queued);
+
+  capture_current=NULL;
+}
+
+// Assign sample buffers from the arena and start the capture thread
+int capture_init(const unsigned long buffsize, const int measurerpm)
+{
+  unsigned int slot;
+  cpu_set_t CPUset;
+
+  capture_buffsize=buffsize;
+  capture_measurerpm=measurerpm;
+  capture_requestslot=0;
+  capture_collectslot=0;
+  capture_current=NULL;
+
+  for (slot=0; slot<CAPTURE_BUFFERS; slot++)
+  {
+    capture_buffers[slot].data=arena_buffer(ARENA_CAPTURE+slot);
+    capture_buffers[slot].state=CAPTURE_FREE;
+
+    if (capture_buffers[slot].data==NULL)
+      return 0;
+
+    sem_init(&capture_ready[slot], 0, 0);
+  }
+
+  sem_init(&capture_queued, 0, 0);
+
+  // Capture thread inherits the scheduling priority and CPU affinity of this thread
+  capture_running=1;
+  if (pthread_create(&capture_thread, NULL, capture_worker, NULL)!=0)
+  {
+    capture_running=0;
+
+    for (slot=0; slot<CAPTURE_BUFFERS; slot++)
+    {
+      capture_buffers[slot].data=NULL;
+
+      sem_destroy(&capture_ready[slot]);
+    }
+
+    sem_destroy(&capture_queued);
+
+    return 0;
+  }
+
+  // If pinned to a single core, leave that core to capture and process on the others
+  if ((sched_getaffinity(0, sizeof(CPUset), &CPUset)==0) && (CPU_COUNT(&CPUset)==1))
+  {
+    cpu_set_t otherCPUs;
+    struct sched_param priority;
+    long numCPUs;
+    int cpu;
+
+    numCPUs=sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&otherCPUs);
+    for (cpu=0; cpu<numCPUs; cpu++)
+      if (!CPU_ISSET(cpu, &CPUset))
+        CPU_SET(cpu, &otherCPUs);
+
+    if (CPU_COUNT(&otherCPUs)>0)
+    {
+      sched_setaffinity(0, sizeof(otherCPUs), &otherCPUs);
+
+      // Processing doesn't need realtime scheduling
+      priority.sched_priority=0;
+      sched_setscheduler(0, SCHED_OTHER, &priority);
+    }
+  }
+
+  return 1;
+}
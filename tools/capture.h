@@ -0,0 +1,57 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+#include "hardware.h"
+
+// Number of sample buffers cycled between the capture and processing threads
+#define CAPTURE_BUFFERS 2
+
+// Sample buffer states
+#define CAPTURE_FREE 0
+#define CAPTURE_QUEUED 1
+#define CAPTURE_SAMPLING 2
+#define CAPTURE_FULL 3
+
+// Time in microseconds between checks on sampling progress
+#define CAPTURE_POLLUS 1000
+
+typedef struct CaptureBuffer
+{
+  // Sampled flux data
+  unsigned char *data;
+
+  // Logical track and side requested
+  int track;
+  int side;
+
+  // Physical position and speed at time of capture
+  uint8_t physical_track;
+  uint8_t physical_head;
+  float rpm;
+
+  // Amount of data sampled, once full
+  unsigned long filled;
+
+  // Positions of index pulses within the sampled data, once full
+  unsigned long indexes[HW_MAXINDEXES];
+  unsigned int indexcount;
+
+  // Set to finish sampling early
+  int stop;
+
+  int state;
+} Capture_Buffer;
+
+extern int capture_init(const unsigned long buffsize, const int measurerpm);
+extern void capture_request(const int track, const int side);
+extern Capture_Buffer *capture_collect();
+extern unsigned long capture_wait(Capture_Buffer *buff, const unsigned long needed);
+extern unsigned long capture_finish(Capture_Buffer *buff);
+extern void capture_stop(Capture_Buffer *buff);
+extern void capture_saveindexes(Capture_Buffer *buff);
+extern void capture_idle();
+extern void capture_done();
+
+#endif
@@ -13,7 +13,8 @@ uint8_t trackmap[WOZ_MAXTRACKS]; // Index for track data within TRKS chunk
 int woz_processheader(FILE *fp)
 {
   long filepos;
-  unsigned char buf;
+  unsigned char buf[WOZ_CRCBLOCKSIZE];
+  size_t buflen;
   uint32_t woz_calccrc=0;
 
   if (fread(&wozheader, sizeof(wozheader), 1, fp)==0)
@@ -34,13 +35,8 @@ int woz_processheader(FILE *fp)
   // Check CRC32
   filepos=ftell(fp);
 
-  while (!feof(fp))
-  {
-    fread(&buf, 1, 1, fp);
-
-    if (!feof(fp))
-      woz_calccrc=CRC32_CalcStream(woz_calccrc, &buf, 1);
-  }
+  while ((buflen=fread(buf, 1, sizeof(buf), fp))>0)
+    woz_calccrc=CRC32_CalcStream(woz_calccrc, buf, buflen);
 
   fseek(fp, filepos, SEEK_SET);
 
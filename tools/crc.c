@@ -1,8 +1,17 @@
 #include <stdint.h>
+#include <pthread.h>
+
 #include "crc.h"
 
-// Configurable CRC16 stream algorithm
-uint16_t calc_crc_stream(const unsigned char *data, const int datalen, const uint16_t initial, const uint16_t polynomial)
+// Tables built so far, one per polynomial
+CRC_Table crc_tables[CRC_MAXTABLES];
+unsigned int crc_tablecount=0;
+
+// Guards building tables, as they're built on first use which may be from several decoding threads
+pthread_mutex_t crc_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// Bit-serial CRC16, for building tables or when no table is available
+uint16_t calc_crc_bitwise(const unsigned char *data, const int datalen, const uint16_t initial, const uint16_t polynomial)
 {
   uint16_t crc=initial;
   int i, j;
@@ -17,8 +26,91 @@ uint16_t calc_crc_stream(const unsigned char *data, const int datalen, const uin
   return (crc & 0xffff);
 }
 
+// Find the lookup tables for a polynomial, building them if this is the first time it's been used
+//   returns NULL if there's no room for another polynomial
+const CRC_Table *calc_crc_table(const uint16_t polynomial)
+{
+  CRC_Table *table;
+  unsigned int count, i, slice;
+
+  // Tables are never changed once counted, so can be used without locking
+  count=__atomic_load_n(&crc_tablecount, __ATOMIC_ACQUIRE);
+  for (i=0; i<count; i++)
+    if (crc_tables[i].polynomial==polynomial)
+      return &crc_tables[i];
+
+  pthread_mutex_lock(&crc_lock);
+
+  // Check again, as it may have been built whilst waiting
+  for (i=0; i<crc_tablecount; i++)
+  {
+    if (crc_tables[i].polynomial==polynomial)
+    {
+      pthread_mutex_unlock(&crc_lock);
+      return &crc_tables[i];
+    }
+  }
+
+  if (crc_tablecount>=CRC_MAXTABLES)
+  {
+    pthread_mutex_unlock(&crc_lock);
+    return NULL;
+  }
+
+  table=&crc_tables[crc_tablecount];
+  table->polynomial=polynomial;
+
+  for (i=0; i<256; i++)
+  {
+    unsigned char byte=i;
+
+    table->slice[0][i]=calc_crc_bitwise(&byte, 1, 0, polynomial);
+  }
+
+  // Each further slice is the one before followed by another zero byte
+  for (slice=1; slice<CRC_SLICES; slice++)
+    for (i=0; i<256; i++)
+      table->slice[slice][i]=CRC_ADDBYTE(table, table->slice[slice-1][i], 0);
+
+  __atomic_store_n(&crc_tablecount, crc_tablecount+1, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&crc_lock);
+
+  return table;
+}
+
+// Configurable CRC16 stream algorithm, processing 8 bytes at a time
+uint16_t calc_crc_stream(const unsigned char *data, const int datalen, const uint16_t initial, const uint16_t polynomial)
+{
+  const CRC_Table *table;
+  uint16_t crc=initial;
+  int i=0;
+
+  table=calc_crc_table(polynomial);
+  if (table==NULL)
+    return calc_crc_bitwise(data, datalen, initial, polynomial);
+
+  for (; (i+CRC_SLICES)<=datalen; i+=CRC_SLICES)
+  {
+    crc=table->slice[7][data[i]^(crc>>8)]^
+        table->slice[6][data[i+1]^(crc&0xff)]^
+        table->slice[5][data[i+2]]^
+        table->slice[4][data[i+3]]^
+        table->slice[3][data[i+4]]^
+        table->slice[2][data[i+5]]^
+        table->slice[1][data[i+6]]^
+        table->slice[0][data[i+7]];
+  }
+
+  // Any remaining bytes one at a time
+  for (; i<datalen; i++)
+    crc=CRC_ADDBYTE(table, crc, data[i]);
+
+  return crc;
+}
+
 // CCITT CRC16 (Floppy Disk Data)
 uint16_t calc_crc(const unsigned char *data, const int datalen)
 {
-  return (calc_crc_stream(data, datalen, 0xffff, 0x1021));
+  return (calc_crc_stream(data, datalen, CRC_CCITT_INITIAL, CRC_CCITT_POLYNOMIAL));
 }
@@ -3,6 +3,28 @@
 
 #include <stdint.h>
 
+// CCITT CRC16 as used by floppy disk controllers
+#define CRC_CCITT_POLYNOMIAL 0x1021
+#define CRC_CCITT_INITIAL 0xffff
+
+// Bytes processed per step of the table-driven CRC, one table for each
+#define CRC_SLICES 8
+
+// Number of different polynomials which can have tables built
+#define CRC_MAXTABLES 4
+
+// Lookup tables for a CRC16 polynomial, slice[n] being the effect of a byte followed by n zero bytes
+typedef struct CRCTable
+{
+  uint16_t polynomial;
+  uint16_t slice[CRC_SLICES][256];
+} CRC_Table;
+
+// Add a single byte to a running CRC16
+#define CRC_ADDBYTE(table, crc, data) ((uint16_t)(((crc)<<8)^(table)->slice[0][(((crc)>>8)^(data))&0xff]))
+
+extern const CRC_Table *calc_crc_table(const uint16_t polynomial);
+
 extern uint16_t calc_crc_stream(const unsigned char *data, const int datalen, const uint16_t initial, const uint16_t polynomial);
 extern uint16_t calc_crc(const unsigned char *data, const int datalen);
 
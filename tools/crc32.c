@@ -39,44 +39,121 @@
   /*  --------------------------------------------------------------------  */
 
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
 #include "crc32.h"
 
-static uint32_t crc32_table[256];
-int crc32_table_generated=0;
+// Slicing tables, crc32_table[n] being the effect of a byte followed by n zero bytes
+static uint32_t crc32_table[CRC32_SLICES][256];
 
-/* CRC-32-IEEE 802.3 (V.42, Ethernet, SATA, MPEG-2, PNG, POSIX cksum) */
-uint32_t CRC32_CalcStream(const uint32_t currcrc, const unsigned char *buf, const int len)
+// x^(2^n) modulo the polynomial, for combining CRCs
+static uint32_t crc32_x2n_table[32];
+
+// Tables are built once, safely from any thread
+static pthread_once_t crc32_table_once=PTHREAD_ONCE_INIT;
+
+// Multiply two polynomials modulo the CRC polynomial, bit reversed as for the CRC
+static uint32_t crc32_multmodp(const uint32_t a, uint32_t b)
 {
-  uint32_t crc;
-  int locallen;
+  uint32_t m=((uint32_t)1<<31);
+  uint32_t p=0;
 
-  // Generate table if we haven't already
-  if (crc32_table_generated==0)
+  while (m!=0)
   {
-    unsigned int i, j;
-    uint32_t h=1;
+    if ((a&m)!=0)
+      p^=b;
 
-    crc32_table[0]=0;
+    m>>=1;
+    b=(b>>1)^((b&1)?CRC32_POLYNOMIAL:0);
+  }
 
-    for (i=128; i; i>>=1)
-    {
-      h = (h>>1)^((h&1)?CRC32_POLYNOMIAL:0);
+  return p;
+}
 
-      /* h is now crc32_table[i] */
+static void crc32_buildtables()
+{
+  unsigned int i, j;
+  uint32_t h=1;
 
-      for (j=0; j<256; j+=2*i)
-        crc32_table[i+j]=crc32_table[j]^h;
-    }
+  crc32_table[0][0]=0;
 
-    crc32_table_generated=1;
+  for (i=128; i; i>>=1)
+  {
+    h = (h>>1)^((h&1)?CRC32_POLYNOMIAL:0);
+
+    /* h is now crc32_table[0][i] */
+
+    for (j=0; j<256; j+=2*i)
+      crc32_table[0][i+j]=crc32_table[0][j]^h;
   }
 
+  // Each further slice is the one before followed by another zero byte
+  for (j=1; j<CRC32_SLICES; j++)
+    for (i=0; i<256; i++)
+      crc32_table[j][i]=(crc32_table[j-1][i]>>8)^crc32_table[0][crc32_table[j-1][i]&0xff];
+
+  // Start at x^1, then keep squaring
+  crc32_x2n_table[0]=((uint32_t)1<<30);
+  for (i=1; i<32; i++)
+    crc32_x2n_table[i]=crc32_multmodp(crc32_x2n_table[i-1], crc32_x2n_table[i-1]);
+}
+
+/* CRC-32-IEEE 802.3 (V.42, Ethernet, SATA, MPEG-2, PNG, POSIX cksum) */
+uint32_t CRC32_CalcStream(const uint32_t currcrc, const unsigned char *buf, const int len)
+{
+  uint32_t crc;
+  int locallen;
+
   locallen=len;
   crc=currcrc;
   crc^=0xffffffff;
 
+#if defined(__ARM_FEATURE_CRC32)
+  // ARMv8 has instructions for this polynomial
+  while (locallen>=8)
+  {
+    uint64_t data;
+
+    memcpy(&data, buf, sizeof(data));
+    crc=__crc32d(crc, data);
+
+    buf+=8;
+    locallen-=8;
+  }
+
+  while (locallen--)
+    crc=__crc32b(crc, *buf++);
+#else
+  // Generate tables if we haven't already
+  pthread_once(&crc32_table_once, crc32_buildtables);
+
+  // 8 bytes at a time, least significant byte first
+  while (locallen>=CRC32_SLICES)
+  {
+    uint32_t lo=crc^(buf[0]|(buf[1]<<8)|(buf[2]<<16)|((uint32_t)buf[3]<<24));
+    uint32_t hi=(buf[4]|(buf[5]<<8)|(buf[6]<<16)|((uint32_t)buf[7]<<24));
+
+    crc=crc32_table[7][lo&0xff]^
+        crc32_table[6][(lo>>8)&0xff]^
+        crc32_table[5][(lo>>16)&0xff]^
+        crc32_table[4][lo>>24]^
+        crc32_table[3][hi&0xff]^
+        crc32_table[2][(hi>>8)&0xff]^
+        crc32_table[1][(hi>>16)&0xff]^
+        crc32_table[0][hi>>24];
+
+    buf+=CRC32_SLICES;
+    locallen-=CRC32_SLICES;
+  }
+
   while (locallen--)
-    crc=(crc>>8)^crc32_table[(crc^*buf++)&0xff];
+    crc=(crc>>8)^crc32_table[0][(crc^*buf++)&0xff];
+#endif
 
   return crc^0xffffffff;
 }
@@ -85,3 +162,22 @@ uint32_t CRC32_Calc(const unsigned char *buf, const int len)
 {
   return CRC32_CalcStream(0, buf, len);
 }
+
+// Find the CRC of two blocks joined together, from the CRC of each and the length of the second
+//   so blocks can have their CRCs calculated separately, such as by different threads
+uint32_t CRC32_Combine(const uint32_t crc1, const uint32_t crc2, const unsigned long len2)
+{
+  unsigned long n;
+  unsigned int k;
+  uint32_t p;
+
+  pthread_once(&crc32_table_once, crc32_buildtables);
+
+  // Work out x^(8*len2), as appending len2 zero bytes would, from the powers of two
+  p=((uint32_t)1<<31);
+  for (n=len2, k=3; n!=0; n>>=1, k++)
+    if ((n&1)!=0)
+      p=crc32_multmodp(crc32_x2n_table[k&31], p);
+
+  return crc32_multmodp(p, crc1)^crc2;
+}
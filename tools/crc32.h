@@ -2,11 +2,16 @@
 #define _CRC32_H_
 
 #include <stdio.h>
+#include <stdint.h>
 
 /* CRC-32-IEEE 802.3 reversed */
 #define CRC32_POLYNOMIAL 0xedb88320
 
+// Bytes processed per step of the table-driven CRC, one table for each
+#define CRC32_SLICES 8
+
 extern uint32_t CRC32_Calc(const unsigned char *buf, const int len);
 extern uint32_t CRC32_CalcStream(const uint32_t currcrc, const unsigned char *buf, const int len);
+extern uint32_t CRC32_Combine(const uint32_t crc1, const uint32_t crc2, const unsigned long len2);
 
 #endif
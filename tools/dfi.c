@@ -2,6 +2,9 @@
 #include <strings.h>
 
 #include "dfi.h"
+#include "arena.h"
+#include "flux.h"
+#include "hardware.h"
 
 /*
 
@@ -82,50 +85,36 @@ void dfi_writeheader(FILE *dfifile)
 unsigned long dfi_encodedata(unsigned char *buffer, const unsigned long maxdfilen, const unsigned char *rawtrackdata, const unsigned long rawdatalength, const unsigned int rotations)
 {
   unsigned long dfilen=0;
-  char state=0;
-  unsigned int i, j;
-  unsigned char carry=0;
+  unsigned long i, edge, nextsample, count;
 
-  // Determine starting sample level
-  state=(rawtrackdata[0]&0x80)>>7;
+  flux_build(&flux_list, rawtrackdata, rawdatalength);
 
-  for (i=0; i<rawdatalength; i++)
+  // Having seen an "original" .dfi file, it looks like it only stores READ pin rising edge deltas
+  nextsample=0;
+  for (edge=flux_list.firstrising; ; edge+=2)
   {
-    unsigned char c;
+    if (edge<flux_list.count)
+      count=(flux_list.edges[edge]+1)-nextsample;
+    else
+      count=(rawdatalength*BITSPERBYTE)-nextsample; // Samples after the last rising edge
 
-    c=rawtrackdata[i];
-
-    // Process each of the 8 sample bits looking for state change
-    for (j=0; j<8; j++)
+    // Add a carry for each whole period which passes without an edge
+    while (count>=DFI_CARRY)
     {
-      carry++;
-
-      if (carry==DFI_CARRY)
-      {
-        // Check for buffer overflow
-        if ((dfilen+1)>=maxdfilen) return 0;
-
-        buffer[dfilen++]=DFI_CARRY;
-        carry=0;
-      }
+      // Check for buffer overflow
+      if ((dfilen+1)>=maxdfilen) return 0;
 
-      if (((c&0x80)>>7)!=state)
-      {
-        state=1-state;
+      buffer[dfilen++]=DFI_CARRY;
+      count-=DFI_CARRY;
+    }
 
-        // Having seen an "original" .dfi file, it looks like it only stores READ pin rising edge deltas
-        if (state==1)
-        {
-          // Check for buffer overflow
-          if ((dfilen+1)>=maxdfilen) return 0;
+    if (edge>=flux_list.count) break;
 
-          buffer[dfilen++]=carry;
-          carry=0;
-        }
-      }
+    // Check for buffer overflow
+    if ((dfilen+1)>=maxdfilen) return 0;
 
-      c=c<<1;
-    }
+    buffer[dfilen++]=count;
+    nextsample=flux_list.edges[edge]+1;
   }
 
   // Simulate an index pulse for each rotation
@@ -158,13 +147,13 @@ void dfi_writetrack(FILE *dfifile, const int track, const int side, const unsign
   // Assume 0 - soft sectored
 
   // Convert data to DFI 2 format
-  dfidata=malloc(rawdatalength);
+  dfidata=arena_borrow(ARENA_WRITESCRATCH, rawdatalength);
   if (dfidata==NULL) return;
 
   dfidatalength=dfi_encodedata(dfidata, rawdatalength, rawtrackdata, rawdatalength, rotations);
   if (dfidatalength==0)
   {
-    free(dfidata);
+    arena_release(ARENA_WRITESCRATCH, dfidata);
     return;
   }
 
@@ -178,5 +167,5 @@ void dfi_writetrack(FILE *dfifile, const int track, const int side, const unsign
   fwrite(trackheader, sizeof(trackheader), 1, dfifile);
   fwrite(dfidata, dfidatalength, 1, dfifile);
 
-  free(dfidata);
+  arena_release(ARENA_WRITESCRATCH, dfidata);
 }
@@ -2,13 +2,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <pthread.h>
 
+#include "arena.h"
 #include "diskstore.h"
+#include "drive.h"
 #include "hardware.h"
 #include "mod.h"
 #include "crc32.h"
 
-Disk_Sector *Disk_SectorsRoot;
+// Sectors for each physical track/head
+Disk_Track diskstore_tracks[DISKSTORE_MAXTRACKS][DISKSTORE_MAXHEADS];
+
+// Chains of sectors with the same hash of their physical position, IDAM and data
+Disk_Sector *diskstore_hash[DISKSTORE_HASHSIZE];
+
+// Sectors found with each modulation
+unsigned int diskstore_modcount[DISKSTORE_MODULATIONS];
 
 // For stats
 int diskstore_mintrack=-1;
@@ -19,6 +29,7 @@ int diskstore_minsectorsize=-1;
 int diskstore_maxsectorsize=-1;
 int diskstore_minsectorid=-1;
 int diskstore_maxsectorid=-1;
+unsigned int diskstore_sectorcount=0;
 
 // For absolute disk access
 int diskstore_abstrack=-1;
@@ -30,12 +41,40 @@ unsigned long diskstore_absoffset=0;
 int diskstore_usepll=0;
 int diskstore_debug=0;
 
+// Guards the sector list and summary information, as sectors may be added by several decoding threads
+pthread_mutex_t diskstore_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// Find the bucket of sectors for a physical track/head, or NULL if out of range
+//   DISKSTORE_MAXTRACKS covers every value a physical track can hold, so only the head needs checking
+Disk_Track *diskstore_gettrack(const uint8_t physical_track, const uint8_t physical_head)
+{
+  if (physical_head>=DISKSTORE_MAXHEADS)
+    return NULL;
+
+  return &diskstore_tracks[physical_track][physical_head];
+}
+
+// Hash everything which makes a sector unique, for spotting ones already stored
+unsigned int diskstore_hashsector(const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const unsigned int idcrc, const unsigned int datatype, const unsigned int datasize, const unsigned int datacrc)
+{
+  uint32_t hash=2166136261U;
+
+  hash=(hash^((physical_track<<8)|physical_head))*16777619U;
+  hash=(hash^((logical_track<<24)|(logical_head<<16)|(logical_sector<<8)|logical_size))*16777619U;
+  hash=(hash^idcrc)*16777619U;
+  hash=(hash^datatype)*16777619U;
+  hash=(hash^datasize)*16777619U;
+  hash=(hash^datacrc)*16777619U;
+
+  return (hash^(hash>>16))&(DISKSTORE_HASHSIZE-1);
+}
+
 // Find sector in store to make sure there is no exact match when adding
 Disk_Sector *diskstore_findexactsector(const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const unsigned int idcrc, const unsigned int datatype, const unsigned int datasize, const unsigned int datacrc)
 {
   Disk_Sector *curr;
 
-  curr=Disk_SectorsRoot;
+  curr=diskstore_hash[diskstore_hashsector(physical_track, physical_head, logical_track, logical_head, logical_sector, logical_size, idcrc, datatype, datasize, datacrc)];
 
   while (curr!=NULL)
   {
@@ -51,7 +90,7 @@ Disk_Sector *diskstore_findexactsector(const uint8_t physical_track, const uint8
         (curr->datacrc==datacrc))
       return curr;
 
-    curr=curr->next;
+    curr=curr->hashnext;
   }
 
   return NULL;
@@ -60,19 +99,24 @@ Disk_Sector *diskstore_findexactsector(const uint8_t physical_track, const uint8
 // Find sector by logical position
 Disk_Sector *diskstore_findlogicalsector(const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector)
 {
-  Disk_Sector *curr;
+  int dtrack, dhead;
+  unsigned int i;
 
-  curr=Disk_SectorsRoot;
+  for (dtrack=0; dtrack<DISKSTORE_MAXTRACKS; dtrack++)
+    for (dhead=0; dhead<DISKSTORE_MAXHEADS; dhead++)
+    {
+      Disk_Track *bucket=&diskstore_tracks[dtrack][dhead];
 
-  while (curr!=NULL)
-  {
-    if ((curr->logical_track==logical_track) &&
-        (curr->logical_head==logical_head) &&
-        (curr->logical_sector==logical_sector))
-      return curr;
+      for (i=0; i<bucket->count; i++)
+      {
+        Disk_Sector *curr=bucket->sectors[i];
 
-    curr=curr->next;
-  }
+        if ((curr->logical_track==logical_track) &&
+            (curr->logical_head==logical_head) &&
+            (curr->logical_sector==logical_sector))
+          return curr;
+      }
+    }
 
   return NULL;
 }
@@ -80,90 +124,123 @@ Disk_Sector *diskstore_findlogicalsector(const uint8_t logical_track, const uint
 // Find sector by hybrid physical/logical position
 Disk_Sector *diskstore_findhybridsector(const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_sector)
 {
-  Disk_Sector *curr;
+  Disk_Track *bucket=diskstore_gettrack(physical_track, physical_head);
 
-  curr=Disk_SectorsRoot;
+  if ((bucket==NULL) || (bucket->byid==NULL))
+    return NULL;
 
-  while (curr!=NULL)
-  {
-    if ((curr->physical_track==physical_track) &&
-        (curr->physical_head==physical_head) &&
-        (curr->logical_sector==logical_sector))
-      return curr;
-
-    curr=curr->next;
-  }
-
-  return NULL;
+  return bucket->byid[logical_sector];
 }
 
 // Find nth sector for given physical track/head
 Disk_Sector *diskstore_findnthsector(const uint8_t physical_track, const uint8_t physical_head, const uint8_t nth_sector)
 {
-  Disk_Sector *curr;
-  int n;
-
-  curr=Disk_SectorsRoot;
-  n=0;
-
-  while (curr!=NULL)
-  {
-    if ((curr->physical_track==physical_track) && (curr->physical_head==physical_head))
-    {
-      if (n==nth_sector)
-        return curr;
-      n++;
-    }
+  Disk_Track *bucket=diskstore_gettrack(physical_track, physical_head);
 
-    curr=curr->next;
-  }
+  if ((bucket==NULL) || (nth_sector>=bucket->count))
+    return NULL;
 
-  return NULL;
+  return bucket->sectors[nth_sector];
 }
 
 // Count how many sectors we have for given physical track/head
 unsigned char diskstore_countsectors(const uint8_t physical_track, const uint8_t physical_head)
 {
-  Disk_Sector *curr;
-  int n;
+  Disk_Track *bucket=diskstore_gettrack(physical_track, physical_head);
 
-  curr=Disk_SectorsRoot;
-  n=0;
+  if (bucket==NULL)
+    return 0;
 
-  while (curr!=NULL)
+  return bucket->count;
+}
+
+// Count how many sectors were found with given modulation
+unsigned int diskstore_countsectormod(const unsigned char modulation)
+{
+  if (modulation>=DISKSTORE_MODULATIONS)
+    return 0;
+
+  return diskstore_modcount[modulation];
+}
+
+// Check if a good copy of a sector with a given IDAM has been found on a physical track/head
+int diskstore_hassector(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const unsigned int idcrc)
+{
+  Disk_Track *bucket=diskstore_gettrack(physical_track, physical_head);
+  unsigned int i;
+  int found=0;
+
+  if (bucket==NULL)
+    return 0;
+
+  pthread_mutex_lock(&diskstore_lock);
+
+  for (i=0; i<bucket->count; i++)
   {
-    if ((curr->physical_track==physical_track) && (curr->physical_head==physical_head))
-      n++;
+    Disk_Sector *curr=bucket->sectors[i];
 
-    curr=curr->next;
+    if ((curr->modulation==modulation) &&
+        (curr->physical_track==physical_track) &&
+        (curr->physical_head==physical_head) &&
+        (curr->logical_track==logical_track) &&
+        (curr->logical_head==logical_head) &&
+        (curr->logical_sector==logical_sector) &&
+        (curr->logical_size==logical_size) &&
+        (curr->idcrc==idcrc))
+    {
+      found=1;
+      break;
+    }
   }
 
-  return n;
+  pthread_mutex_unlock(&diskstore_lock);
+
+  return found;
 }
 
-// Count how many sectors were found with given modulation
-unsigned int diskstore_countsectormod(const unsigned char modulation)
+// Find the rotations for sectors not yet placed on the track/head just demodulated, once the index positions are known
+void diskstore_placesectors(const struct ModContext *context)
 {
-  Disk_Sector *curr;
-  unsigned int n;
+  Disk_Track *bucket=diskstore_gettrack(context->track, context->head);
+  unsigned int i;
 
-  curr=Disk_SectorsRoot;
-  n=0;
+  if (bucket==NULL)
+    return;
 
-  while (curr!=NULL)
+  pthread_mutex_lock(&diskstore_lock);
+
+  for (i=0; i<bucket->count; i++)
   {
-    if (curr->modulation==modulation)
-      n++;
+    Disk_Sector *curr=bucket->sectors[i];
 
-    curr=curr->next;
+    if (curr->rotation_len==0)
+      mod_rotation(context, curr->id_pos, &curr->rotation_start, &curr->rotation_len);
   }
 
-  return n;
+  pthread_mutex_unlock(&diskstore_lock);
+}
+
+// Determine how far round its rotation a position within a sector is, as a percentage
+int diskstore_rotationpercent(const Disk_Sector *sector, const unsigned long pos)
+{
+  unsigned long offset;
+
+  if (sector->rotation_len==0)
+    return 0;
+
+  if (pos>=sector->rotation_start)
+    offset=(pos-sector->rotation_start)%sector->rotation_len;
+  else
+    offset=(sector->rotation_len-((sector->rotation_start-pos)%sector->rotation_len))%sector->rotation_len;
+
+  return (offset*100)/sector->rotation_len;
 }
 
 // Compare two sectors to determine if they should be swapped
 int diskstore_comparesectors(Disk_Sector *item1, Disk_Sector *item2, const int sortmethod, const int rotations)
 {
+  (void) rotations;
+
   if ((item1==NULL) || (item2==NULL))
     return 0;
 
@@ -193,14 +270,11 @@ int diskstore_comparesectors(Disk_Sector *item1, Disk_Sector *item2, const int s
   else
   if (sortmethod==SORTBYPOS)
   {
-    unsigned long samplesperrotation;
     int item1dpos;
     int item2dpos;
 
-    samplesperrotation=(mod_samplesize/rotations);
-
-    item1dpos=((item1->data_pos%samplesperrotation)*100)/samplesperrotation;
-    item2dpos=((item2->data_pos%samplesperrotation)*100)/samplesperrotation;
+    item1dpos=diskstore_rotationpercent(item1, item1->data_pos);
+    item2dpos=diskstore_rotationpercent(item2, item2->data_pos);
 
     if (item1dpos > item2dpos)
       return 1;
@@ -213,64 +287,167 @@ int diskstore_comparesectors(Disk_Sector *item1, Disk_Sector *item2, const int s
   return 0;
 }
 
-// Bubble sort the sectors to one of the sort methods
-void diskstore_sortsectors(const int sortmethod, const int rotations)
+// Point each logical sector id at the first sector with that id, in the order they are held for a track/head
+void diskstore_indexsectors(Disk_Track *bucket)
 {
-  int swaps;
-  Disk_Sector *curr;
-  Disk_Sector *swap;
+  int i;
 
-  // Check for empty diskstore
-  if (Disk_SectorsRoot==NULL)
+  if (bucket->byid==NULL)
     return;
 
-  do
-  {
-    Disk_Sector *prev;
+  for (i=0; i<256; i++)
+    bucket->byid[i]=NULL;
+
+  for (i=bucket->count-1; i>=0; i--)
+    bucket->byid[bucket->sectors[i]->logical_sector]=bucket->sectors[i];
+}
 
-    swaps=0;
-    curr=Disk_SectorsRoot;
-    prev=NULL;
+// Sort the sectors to one of the sort methods
+//   tracks and heads are already apart, so each track/head is sorted on its own, keeping the order of equal sectors
+void diskstore_sortsectors(const int sortmethod, const int rotations)
+{
+  int dtrack, dhead;
 
-    while ((curr!=NULL) && (curr->next!=NULL))
+  for (dtrack=0; dtrack<DISKSTORE_MAXTRACKS; dtrack++)
+    for (dhead=0; dhead<DISKSTORE_MAXHEADS; dhead++)
     {
-      // Check if these two sectors need swapping
-      if (diskstore_comparesectors(curr, curr->next, sortmethod, rotations)==1)
+      Disk_Track *bucket=&diskstore_tracks[dtrack][dhead];
+      unsigned int i, j;
+
+      if (bucket->count<2)
+        continue;
+
+      // Insertion sort, as there are only ever a few tens of sectors to a track
+      for (i=1; i<bucket->count; i++)
       {
-        // Swap the pointers over in the linked list
-        swap=curr->next;
-        curr->next=swap->next;
-        swap->next=curr;
+        Disk_Sector *curr=bucket->sectors[i];
 
-        if (prev==NULL)
-          Disk_SectorsRoot=swap;
-        else
-          prev->next=swap;
+        for (j=i; (j>0) && (diskstore_comparesectors(bucket->sectors[j-1], curr, sortmethod, rotations)==1); j--)
+          bucket->sectors[j]=bucket->sectors[j-1];
 
-        swaps++;
+        bucket->sectors[j]=curr;
       }
 
-      // Move on to the next pair of sectors
-      prev=curr;
-      curr=curr->next;
+      diskstore_indexsectors(bucket);
     }
-  } while (swaps>0);
 }
 
-// Add a sector to linked list
-int diskstore_addsector(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const long id_pos, const unsigned int idcrc, const long data_pos, const unsigned int datatype, const unsigned int datasize, const unsigned char *data, const unsigned int datacrc)
+// Remove a sector from its hash chain
+void diskstore_unhashsector(Disk_Sector *sector)
 {
-  Disk_Sector *curr;
+  Disk_Sector **link;
+
+  link=&diskstore_hash[diskstore_hashsector(sector->physical_track, sector->physical_head, sector->logical_track, sector->logical_head, sector->logical_sector, sector->logical_size, sector->idcrc, sector->datatype, sector->datasize, sector->datacrc)];
+
+  while (*link!=NULL)
+  {
+    if (*link==sector)
+    {
+      *link=sector->hashnext;
+      return;
+    }
+
+    link=&(*link)->hashnext;
+  }
+}
+
+// Find where a sector fused from bad copies of the same IDAM is held on a track/head
+//   returns -1 if there isn't one
+int diskstore_findfusedsector(const Disk_Track *bucket, const unsigned char modulation, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const unsigned int idcrc)
+{
+  unsigned int i;
+
+  for (i=0; i<bucket->count; i++)
+  {
+    Disk_Sector *curr=bucket->sectors[i];
+
+    if ((curr->fused) &&
+        (curr->modulation==modulation) &&
+        (curr->logical_track==logical_track) &&
+        (curr->logical_head==logical_head) &&
+        (curr->logical_sector==logical_sector) &&
+        (curr->logical_size==logical_size) &&
+        (curr->idcrc==idcrc))
+      return i;
+  }
+
+  return -1;
+}
+
+// Add a sector to the store for its track/head, either read with a good CRC or fused from bad copies
+//   a good read takes the place of a sector fused from the same IDAM, as fusing may have found a false CRC match
+int diskstore_storesector(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const long id_pos, const unsigned int idcrc, const long data_pos, const long data_endpos, const unsigned int datatype, const unsigned int datasize, const unsigned char *data, const unsigned int datacrc, const int fused)
+{
+  Disk_Track *bucket;
   Disk_Sector *newitem;
+  Disk_Sector *curr;
+  unsigned int hash;
+  int replace=-1;
+
+  bucket=diskstore_gettrack(physical_track, physical_head);
+  if (bucket==NULL)
+    return 0;
+
+  pthread_mutex_lock(&diskstore_lock);
 
   // First check if we already have this sector
-  if (diskstore_findexactsector(physical_track, physical_head, logical_track, logical_head, logical_sector, logical_size, idcrc, datatype, datasize, datacrc)!=NULL)
+  curr=diskstore_findexactsector(physical_track, physical_head, logical_track, logical_head, logical_sector, logical_size, idcrc, datatype, datasize, datacrc);
+  if (curr!=NULL)
+  {
+    // Read with a good CRC after being fused, so no longer in doubt
+    if ((curr->fused) && (!fused))
+    {
+      curr->fused=0;
+
+      if ((bucket->byid[logical_sector]==NULL) || (bucket->byid[logical_sector]->fused))
+        bucket->byid[logical_sector]=curr;
+
+      // Let completion checks know the track has changed
+      __atomic_add_fetch(&diskstore_sectorcount, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&diskstore_lock);
     return 0;
+  }
+
+  if (!fused)
+    replace=diskstore_findfusedsector(bucket, modulation, logical_track, logical_head, logical_sector, logical_size, idcrc);
 
 //  fprintf(stderr, "Adding physical T:%d H:%d  |  logical C:%d H:%d R:%d N:%d (%.4x) [%.2x] %d data bytes (%.4x)\n", physical_track, physical_head, logical_track, logical_head, logical_sector, logical_size, idcrc, datatype, datasize, datacrc);
 
+  // Make room for another sector on this track/head
+  if ((replace==-1) && (bucket->count==bucket->size))
+  {
+    Disk_Sector **sectors;
+    unsigned int size=(bucket->size==0)?32:(bucket->size*2);
+
+    sectors=realloc(bucket->sectors, size*sizeof(Disk_Sector *));
+    if (sectors==NULL)
+    {
+      pthread_mutex_unlock(&diskstore_lock);
+      return 0;
+    }
+
+    bucket->sectors=sectors;
+    bucket->size=size;
+  }
+
+  if (bucket->byid==NULL)
+  {
+    bucket->byid=calloc(256, sizeof(Disk_Sector *));
+    if (bucket->byid==NULL)
+    {
+      pthread_mutex_unlock(&diskstore_lock);
+      return 0;
+    }
+  }
+
   newitem=malloc(sizeof(Disk_Sector));
-  if (newitem==NULL) return 0;
+  if (newitem==NULL)
+  {
+    pthread_mutex_unlock(&diskstore_lock);
+    return 0;
+  }
 
   newitem->physical_track=physical_track;
   newitem->physical_head=physical_head;
@@ -282,7 +459,11 @@ int diskstore_addsector(const unsigned char modulation, const uint8_t physical_t
   newitem->idcrc=idcrc;
   newitem->id_pos=id_pos;
   newitem->data_pos=data_pos;
-  newitem->data_endpos=mod_datapos;
+  newitem->data_endpos=data_endpos;
+
+  // Placed within a rotation once the index positions are known
+  newitem->rotation_start=0;
+  newitem->rotation_len=0;
 
   newitem->modulation=modulation;
 
@@ -294,8 +475,7 @@ int diskstore_addsector(const unsigned char modulation, const uint8_t physical_t
     memcpy(newitem->data, data, datasize);
 
   newitem->datacrc=datacrc;
-
-  newitem->next=NULL;
+  newitem->fused=fused;
 
   if ((diskstore_mintrack==-1) || (physical_track<diskstore_mintrack))
     diskstore_mintrack=physical_track;
@@ -321,46 +501,94 @@ int diskstore_addsector(const unsigned char modulation, const uint8_t physical_t
   if ((diskstore_minsectorid==-1) || (logical_sector<diskstore_minsectorid))
     diskstore_minsectorid=logical_sector;
 
-  // Add the new sector to the dynamic linked list
-  if (Disk_SectorsRoot==NULL)
+  if (replace!=-1)
   {
-    Disk_SectorsRoot=newitem;
+    // Take the place of the fused sector
+    curr=bucket->sectors[replace];
+    bucket->sectors[replace]=newitem;
+
+    if (bucket->byid[logical_sector]==curr)
+      bucket->byid[logical_sector]=newitem;
+
+    diskstore_unhashsector(curr);
+
+    if (curr->modulation<DISKSTORE_MODULATIONS)
+      diskstore_modcount[curr->modulation]--;
+
+    free(curr->data);
+    free(curr);
   }
   else
   {
-    curr=Disk_SectorsRoot;
+    // Add the new sector to the end of its track/head
+    bucket->sectors[bucket->count++]=newitem;
+  }
 
-    while (curr->next!=NULL)
-      curr=curr->next;
+  // Sectors read with a good CRC are preferred over fused ones for each id
+  if ((bucket->byid[logical_sector]==NULL) || ((bucket->byid[logical_sector]->fused) && (!fused)))
+    bucket->byid[logical_sector]=newitem;
 
-    curr->next=newitem;
-  }
+  hash=diskstore_hashsector(physical_track, physical_head, logical_track, logical_head, logical_sector, logical_size, idcrc, datatype, datasize, datacrc);
+  newitem->hashnext=diskstore_hash[hash];
+  diskstore_hash[hash]=newitem;
+
+  if (modulation<DISKSTORE_MODULATIONS)
+    diskstore_modcount[modulation]++;
+
+  __atomic_add_fetch(&diskstore_sectorcount, 1, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&diskstore_lock);
 
   return 1;
 }
 
+// Add a sector read with a good CRC
+int diskstore_addsector(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const long id_pos, const unsigned int idcrc, const long data_pos, const long data_endpos, const unsigned int datatype, const unsigned int datasize, const unsigned char *data, const unsigned int datacrc)
+{
+  return diskstore_storesector(modulation, physical_track, physical_head, logical_track, logical_head, logical_sector, logical_size, id_pos, idcrc, data_pos, data_endpos, datatype, datasize, data, datacrc, 0);
+}
+
+// Add a sector fused from bad copies, which is replaced if later read with a good CRC
+int diskstore_addfusedsector(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const long id_pos, const unsigned int idcrc, const long data_pos, const long data_endpos, const unsigned int datatype, const unsigned int datasize, const unsigned char *data, const unsigned int datacrc)
+{
+  return diskstore_storesector(modulation, physical_track, physical_head, logical_track, logical_head, logical_sector, logical_size, id_pos, idcrc, data_pos, data_endpos, datatype, datasize, data, datacrc, 1);
+}
+
 // Delete all saved sectors
 void diskstore_clearallsectors()
 {
-  Disk_Sector *curr;
+  int dtrack, dhead;
+  unsigned int i;
 
-  curr=Disk_SectorsRoot;
+  for (dtrack=0; dtrack<DISKSTORE_MAXTRACKS; dtrack++)
+    for (dhead=0; dhead<DISKSTORE_MAXHEADS; dhead++)
+    {
+      Disk_Track *bucket=&diskstore_tracks[dtrack][dhead];
 
-  while (curr!=NULL)
-  {
-    void *prev;
+      for (i=0; i<bucket->count; i++)
+      {
+        if (bucket->sectors[i]->data!=NULL)
+          free(bucket->sectors[i]->data);
 
-    if (curr->data!=NULL)
-      free(curr->data);
+        free(bucket->sectors[i]);
+      }
 
-    prev=curr;
-    curr=curr->next;
+      free(bucket->sectors);
+      free(bucket->byid);
 
-    if (prev!=NULL)
-      free(prev);
-  }
+      bucket->sectors=NULL;
+      bucket->count=0;
+      bucket->size=0;
+      bucket->byid=NULL;
+    }
+
+  for (i=0; i<DISKSTORE_HASHSIZE; i++)
+    diskstore_hash[i]=NULL;
+
+  for (i=0; i<DISKSTORE_MODULATIONS; i++)
+    diskstore_modcount[i]=0;
 
-  Disk_SectorsRoot=NULL;
+  diskstore_sectorcount=0;
 }
 
 // Dump a list of all sectors found
@@ -370,6 +598,7 @@ void diskstore_dumpsectorlist()
   int dtrack, dhead;
   int n;
   int totalsectors=0;
+  int fusedsectors=0;
 
   for (dtrack=0; dtrack<(diskstore_maxtrack+1); dtrack+=hw_stepping)
   {
@@ -385,7 +614,15 @@ void diskstore_dumpsectorlist()
         if (curr!=NULL)
         {
           totalsectors++;
-          fprintf(stderr, "%d[%d] ", curr->logical_sector, curr->physical_head);
+
+          // Fused sectors are marked, as they weren't read with a good CRC
+          if (curr->fused)
+          {
+            fusedsectors++;
+            fprintf(stderr, "%d[%d]F ", curr->logical_sector, curr->physical_head);
+          }
+          else
+            fprintf(stderr, "%d[%d] ", curr->logical_sector, curr->physical_head);
         }
       } while (curr!=NULL);
     }
@@ -393,20 +630,31 @@ void diskstore_dumpsectorlist()
   }
 
   fprintf(stderr, "Total extracted sectors: %d\n", totalsectors);
+
+  if (fusedsectors!=0)
+    fprintf(stderr, "Fused from bad copies (F): %d\n", fusedsectors);
 }
 
-// Dump a list of all sectors found
+// Dump a list of all sectors which are missing, or only fused from bad copies
 void diskstore_dumpbadsectors(FILE* fh)
 {
+  Disk_Sector *curr;
   int dtrack, dhead,dsector;
 
-  fprintf(fh, "Head, Track, Sector\n");
+  fprintf(fh, "Head, Track, Sector, Status\n");
 
   for (dhead=0; dhead<(diskstore_maxhead+1); dhead++)
     for (dtrack=0; dtrack<(diskstore_maxtrack+1); dtrack+=hw_stepping)
       for(dsector=0; dsector<(diskstore_maxsectorid+1); dsector++)
-         if(diskstore_findhybridsector(dtrack, dhead, dsector)==NULL)
-            fprintf(fh, "%.2X, %.2X, %.2X\n", dhead, dtrack, dsector);
+      {
+         curr=diskstore_findhybridsector(dtrack, dhead, dsector);
+
+         if (curr==NULL)
+            fprintf(fh, "%.2X, %.2X, %.2X, Missing\n", dhead, dtrack, dsector);
+         else
+         if (curr->fused)
+            fprintf(fh, "%.2X, %.2X, %.2X, Fused\n", dhead, dtrack, dsector);
+      }
 }
 
 // Dump a layout map of where data was found on the disk surface
@@ -416,7 +664,6 @@ void diskstore_dumplayoutmap(const int rotations)
   int dtrack, dhead;
   char cyldata[100+1];
   int i, n, ppos, ppos2;
-  unsigned long samplesperrotation;
   int mtrack;
 
   if ((diskstore_maxtrack>-1) && (diskstore_maxtrack<(int)hw_maxtracks))
@@ -425,7 +672,6 @@ void diskstore_dumplayoutmap(const int rotations)
     mtrack=hw_maxtracks+1;
 
   fprintf(stderr, "Samples : %lu  Rotations : %d\n", mod_samplesize, rotations);
-  samplesperrotation=(mod_samplesize/rotations);
 
   fprintf(stderr, "TRACK[HEAD]\n");
   for (dtrack=0; ((dtrack<mtrack) && (dtrack<(int)hw_maxtracks)); dtrack+=hw_stepping)
@@ -446,8 +692,8 @@ void diskstore_dumplayoutmap(const int rotations)
 
         if (curr!=NULL)
         {
-          ppos=((curr->data_pos%samplesperrotation)*100)/samplesperrotation;
-          ppos2=((curr->data_endpos%samplesperrotation)*100)/samplesperrotation;
+          ppos=diskstore_rotationpercent(curr, curr->data_pos);
+          ppos2=diskstore_rotationpercent(curr, curr->data_endpos);
 
           // Check for data block wrap
           if (ppos>ppos2)
@@ -461,7 +707,7 @@ void diskstore_dumplayoutmap(const int rotations)
           for (i=ppos; i<ppos2; i++)
             cyldata[i%100]='d';
 
-          ppos=((curr->id_pos%samplesperrotation)*100)/samplesperrotation;
+          ppos=diskstore_rotationpercent(curr, curr->id_pos);
           cyldata[ppos%100]='s';
         }
       } while (curr!=NULL);
@@ -585,20 +831,21 @@ unsigned long diskstore_absoluteread(char *buffer, const unsigned long bufflen,
       unsigned long samplebuffsize;
 
       samplebuffsize=((hw_samplerate/HW_ROTATIONSPERSEC)/BITSPERBYTE)*3;
-      samplebuffer=malloc(samplebuffsize);
+      samplebuffer=arena_borrow(ARENA_SAMPLE, samplebuffsize);
 
       if (samplebuffer!=NULL)
       {
         hw_seektotrack(diskstore_abstrack);
         hw_sideselect(diskstore_abshead);
-        hw_sleep(1);
+        drive_settle(DRIVE_SETTLESTEP);
         hw_samplerawtrackdata(samplebuffer, samplebuffsize);
-        mod_process(samplebuffer, samplebuffsize, 99, 0);
+        mod_setindexes(&mod_context, hw_indexpos, hw_indexcount);
+        mod_process(&mod_context, samplebuffer, samplebuffsize, hw_currenttrack, hw_currenthead, hw_rpm, 99, 0);
 
         if (diskstore_usepll)
-          mod_process(samplebuffer, samplebuffsize, 99, diskstore_usepll);
+          mod_process(&mod_context, samplebuffer, samplebuffsize, hw_currenttrack, hw_currenthead, hw_rpm, 99, diskstore_usepll);
 
-        free(samplebuffer);
+        arena_release(ARENA_SAMPLE, samplebuffer);
         samplebuffer=NULL;
       }
       else
@@ -684,7 +931,23 @@ uint32_t diskstore_calcdiskcrc(const uint8_t physical_head)
 
 void diskstore_init(const int debug, const int usepll)
 {
-  Disk_SectorsRoot=NULL;
+  int dtrack, dhead;
+  unsigned int i;
+
+  for (dtrack=0; dtrack<DISKSTORE_MAXTRACKS; dtrack++)
+    for (dhead=0; dhead<DISKSTORE_MAXHEADS; dhead++)
+    {
+      diskstore_tracks[dtrack][dhead].sectors=NULL;
+      diskstore_tracks[dtrack][dhead].count=0;
+      diskstore_tracks[dtrack][dhead].size=0;
+      diskstore_tracks[dtrack][dhead].byid=NULL;
+    }
+
+  for (i=0; i<DISKSTORE_HASHSIZE; i++)
+    diskstore_hash[i]=NULL;
+
+  for (i=0; i<DISKSTORE_MODULATIONS; i++)
+    diskstore_modcount[i]=0;
 
   diskstore_debug=debug;
   diskstore_usepll=usepll;
@@ -697,6 +960,7 @@ void diskstore_init(const int debug, const int usepll)
   diskstore_maxsectorsize=-1;
   diskstore_minsectorid=-1;
   diskstore_maxsectorid=-1;
+  diskstore_sectorcount=0;
 
   diskstore_abstrack=-1;
   diskstore_abshead=-1;
@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 
+// Demodulation state, defined in mod.h
+struct ModContext;
+
 // For sector status
 #define NODATA 0
 #define BADDATA 1
@@ -22,6 +25,16 @@
 #define SORTBYID 0
 #define SORTBYPOS 1
 
+// Sectors are kept in a bucket per physical track/head, covering every possible track number
+#define DISKSTORE_MAXTRACKS 256
+#define DISKSTORE_MAXHEADS 2
+
+// Number of hash chains used to spot sectors which have already been stored, a power of 2
+#define DISKSTORE_HASHSIZE 4096
+
+// Number of modulation types counted
+#define DISKSTORE_MODULATIONS (MODAPPLEGCR+1)
+
 typedef struct DiskSector
 {
   // Physical position of sector on disk
@@ -46,11 +59,28 @@ typedef struct DiskSector
   unsigned char *data;
   unsigned int datacrc;
 
-  struct DiskSector *next;
+  // Set when the data was fused from bad copies, rather than read with a good CRC
+  int fused;
+
+  // Rotation the sector was found in, from index pulse positions, length is 0 until placed
+  unsigned long rotation_start;
+  unsigned long rotation_len;
+
+  // Next sector with the same hash
+  struct DiskSector *hashnext;
 } Disk_Sector;
 
-// Linked list
-extern Disk_Sector *Disk_SectorsRoot;
+// All the sectors found on a physical track/head
+typedef struct DiskTrack
+{
+  // In the order they were found, or as sorted
+  Disk_Sector **sectors;
+  unsigned int count;
+  unsigned int size;
+
+  // First of the sectors for each logical sector id, allocated along with the sectors
+  Disk_Sector **byid;
+} Disk_Track;
 
 // Summary information
 extern int diskstore_mintrack;
@@ -61,6 +91,7 @@ extern int diskstore_minsectorsize;
 extern int diskstore_maxsectorsize;
 extern int diskstore_minsectorid;
 extern int diskstore_maxsectorid;
+extern unsigned int diskstore_sectorcount;
 
 // For absolute disk access
 extern int diskstore_abstrack;
@@ -72,19 +103,22 @@ extern unsigned long diskstore_absoffset;
 // Initialise disk storage
 extern void diskstore_init(const int debug, const int usepll);
 
-// Add a sector to the disk storage
-extern int diskstore_addsector(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const long id_pos, const unsigned int idcrc, const long data_pos, const unsigned int datatype, const unsigned int datasize, const unsigned char *data, const unsigned int datacrc);
+// Add a sector to the disk storage, either read with a good CRC or fused from bad copies
+extern int diskstore_addfusedsector(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const long id_pos, const unsigned int idcrc, const long data_pos, const long data_endpos, const unsigned int datatype, const unsigned int datasize, const unsigned char *data, const unsigned int datacrc);
+extern int diskstore_addsector(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const long id_pos, const unsigned int idcrc, const long data_pos, const long data_endpos, const unsigned int datatype, const unsigned int datasize, const unsigned char *data, const unsigned int datacrc);
 
 // Search for a sector within the disk storage
 extern Disk_Sector *diskstore_findexactsector(const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const unsigned int idcrc, const unsigned int datatype, const unsigned int datasize, const unsigned int datacrc);
 extern Disk_Sector *diskstore_findlogicalsector(const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector);
 extern Disk_Sector *diskstore_findhybridsector(const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_sector);
 extern Disk_Sector *diskstore_findnthsector(const uint8_t physical_track, const uint8_t physical_head, const unsigned char nth_sector);
+extern int diskstore_hassector(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const unsigned int idcrc);
 
 // Processing of sectors
 extern unsigned char diskstore_countsectors(const uint8_t physical_track, const uint8_t physical_head);
 extern unsigned int diskstore_countsectormod(const unsigned char modulation);
 extern void diskstore_sortsectors(const int sortmethod, const int rotations);
+extern void diskstore_placesectors(const struct ModContext *context);
 
 // Dump the contents of the disk storage for debug purposes
 extern void diskstore_dumpsectorlist();
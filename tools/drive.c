@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "hardware.h"
+#include "drive.h"
+
+// Known drive profiles, the first is used by default
+//   the default steps at the slowest rate as a missed step silently reads the wrong track
+static const Drive_Profile drive_profiles[] = {
+  {"generic", "Generic drive", HW_MAXSTEPRATE, 500, 25, 1},
+  {"525", "Older 5.25 inch drive", 20, 750, 30, 1},
+  {"fd235hg", "TEAC FD-235HG 3.5 inch drive", 3, 480, 15, 1},
+  {"slow", "Slow stepping drive", HW_MAXSTEPRATE, 750, 30, 1},
+  {NULL, NULL, 0, 0, 0, 0}
+};
+
+const Drive_Profile *drive_profile=&drive_profiles[0];
+int drive_settlepolicy=DRIVE_SETTLEADAPTIVE;
+
+// Accounting for time spent settling
+unsigned int drive_settles=0;
+unsigned long long drive_settletime=0;
+
+// Accounting for time spent seeking
+unsigned long long drive_seektime=0;
+
+// Get current time in microseconds
+unsigned long long drive_gettime()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (((unsigned long long)tv.tv_sec)*USINSECOND)+tv.tv_usec;
+}
+
+// Select drive profile by name
+int drive_setprofile(const char *name)
+{
+  int i;
+
+  for (i=0; drive_profiles[i].name!=NULL; i++)
+  {
+    if (strcmp(drive_profiles[i].name, name)==0)
+    {
+      drive_profile=&drive_profiles[i];
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Show available drive profiles
+void drive_listprofiles(FILE *fp)
+{
+  int i;
+
+  for (i=0; drive_profiles[i].name!=NULL; i++)
+    fprintf(fp, "  %-8s %s\n", drive_profiles[i].name, drive_profiles[i].description);
+}
+
+// Wait for the drive to settle after motor start, seek or head switch
+void drive_settle(const int reason)
+{
+  unsigned long long starttime;
+
+  starttime=drive_gettime();
+
+  if (drive_settlepolicy==DRIVE_SETTLEFIXED)
+  {
+    hw_sleep(DRIVE_FIXEDSETTLE);
+  }
+  else
+  {
+    long long expected, period, lastindex, now;
+    int i;
+
+    // Wait for the minimum time this drive needs
+    switch (reason)
+    {
+      case DRIVE_SETTLEMOTOR:
+        hw_delay(drive_profile->spinup);
+        break;
+
+      case DRIVE_SETTLESTEP:
+        hw_delay(drive_profile->stepsettle);
+        break;
+
+      default:
+        hw_delay(drive_profile->headsettle);
+        break;
+    }
+
+    // Start off expecting the index period for the last known speed
+    expected=(SECONDSINMINUTE*USINSECOND)/hw_rpm;
+
+    hw_waitforindex();
+    lastindex=drive_gettime();
+
+    // Wait until the index to index period is stable
+    for (i=0; i<DRIVE_MAXINDEXES; i++)
+    {
+      hw_waitforindex();
+      now=drive_gettime();
+
+      period=now-lastindex;
+      lastindex=now;
+
+      if ((period>=(expected-(expected/DRIVE_INDEXTOLERANCE))) &&
+          (period<=(expected+(expected/DRIVE_INDEXTOLERANCE))))
+        break;
+
+      expected=period;
+    }
+  }
+
+  drive_settles++;
+  drive_settletime+=(drive_gettime()-starttime);
+}
+
+// Total time spent settling
+float drive_settleseconds()
+{
+  return ((float)drive_settletime/USINSECOND);
+}
+
+// Time saved over using fixed settling
+float drive_settlesaved()
+{
+  return ((float)drive_settles*DRIVE_FIXEDSETTLE)-drive_settleseconds();
+}
+
+// Seek to a track, stepping as fast as this drive allows, settling is left to the caller
+void drive_seek(const int track)
+{
+  unsigned long long starttime;
+
+  starttime=drive_gettime();
+
+  hw_setsteprate(drive_profile->steprate);
+
+  // Track zero is found using the sensor, even if the current position is unknown
+  if (track==0)
+    hw_seektotrackzero();
+  else
+    hw_seektotrack(track);
+
+  drive_seektime+=(drive_gettime()-starttime);
+}
+
+// Total number of head steps
+unsigned long drive_seeksteps()
+{
+  return hw_stepcount;
+}
+
+// Total time spent seeking
+float drive_seekseconds()
+{
+  return ((float)drive_seektime/USINSECOND);
+}
+
+// Time saved over stepping at the slowest rate
+float drive_seeksaved()
+{
+  return (((float)hw_stepcount*HW_MAXSTEPRATE)/1000)-drive_seekseconds();
+}
@@ -0,0 +1,53 @@
+#ifndef _DRIVE_H_
+#define _DRIVE_H_
+
+#include <stdio.h>
+
+// Settle policies
+#define DRIVE_SETTLEFIXED 0
+#define DRIVE_SETTLEADAPTIVE 1
+
+// Reasons for waiting for the drive to settle
+#define DRIVE_SETTLEMOTOR 0
+#define DRIVE_SETTLESTEP 1
+#define DRIVE_SETTLEHEAD 2
+
+// Settle time in seconds when using fixed settling
+#define DRIVE_FIXEDSETTLE 1
+
+// Maximum number of index periods to wait for the speed to stabilise
+#define DRIVE_MAXINDEXES 5
+
+// Allowed variation in index period between rotations, as 1/x
+#define DRIVE_INDEXTOLERANCE 100
+
+typedef struct DriveProfile
+{
+  const char *name;
+  const char *description;
+
+  // Minimum time in milliseconds between step pulses
+  unsigned int steprate;
+
+  // Minimum times in milliseconds to wait before checking index period
+  unsigned int spinup; // After starting motor
+  unsigned int stepsettle; // After stepping
+  unsigned int headsettle; // After head switch
+} Drive_Profile;
+
+extern const Drive_Profile *drive_profile;
+extern int drive_settlepolicy;
+
+extern int drive_setprofile(const char *name);
+extern void drive_listprofiles(FILE *fp);
+
+extern void drive_settle(const int reason);
+extern float drive_settleseconds();
+extern float drive_settlesaved();
+
+extern void drive_seek(const int track);
+extern unsigned long drive_seeksteps();
+extern float drive_seekseconds();
+extern float drive_seeksaved();
+
+#endif
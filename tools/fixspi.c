@@ -0,0 +1,84 @@
+#include <stdint.h>
+
+#include "hardware.h"
+
+// State carried between blocks when fixing SPI sample timings
+uint64_t hw_fixo;
+unsigned int hw_fixolen;
+long hw_fixoutpos;
+
+// Start fixing a new set of SPI samples
+void hw_fixspireset()
+{
+  hw_fixo=0; hw_fixolen=0;
+  hw_fixoutpos=0;
+}
+
+// Fix the next block of SPI samples, continuing from the previous block
+//   SPI sampling leaves a 1 sample gap between each group of 8 samples, so each raw
+//   byte becomes 9 samples by repeating its first sample. These are packed into an
+//   accumulator several bytes at a time, rather than a bit at a time.
+void hw_fixspiblock(const unsigned char *inbuf, long inlen, unsigned char *outbuf, long outlen)
+{
+  long inpos;
+  uint64_t o;
+  unsigned int olen;
+
+  o=hw_fixo; olen=hw_fixolen;
+  inpos=0;
+
+  // Whilst all the output will fit, 4 raw bytes give 36 samples, which with up to 7 left over still fit the accumulator
+  while (((inlen-inpos)>=HW_FIXGROUP) && ((hw_fixoutpos+HW_FIXGROUP+1)<=outlen))
+  {
+    o=(o<<(HW_FIXSAMPLES*HW_FIXGROUP))|
+      (HW_FIXBYTE(inbuf[inpos])<<(HW_FIXSAMPLES*3))|
+      (HW_FIXBYTE(inbuf[inpos+1])<<(HW_FIXSAMPLES*2))|
+      (HW_FIXBYTE(inbuf[inpos+2])<<HW_FIXSAMPLES)|
+      HW_FIXBYTE(inbuf[inpos+3]);
+    olen+=(HW_FIXSAMPLES*HW_FIXGROUP);
+    inpos+=HW_FIXGROUP;
+
+    outbuf[hw_fixoutpos++]=o>>(olen-8);
+    outbuf[hw_fixoutpos++]=o>>(olen-16);
+    outbuf[hw_fixoutpos++]=o>>(olen-24);
+    outbuf[hw_fixoutpos++]=o>>(olen-32);
+    olen-=32;
+
+    if (olen>=BITSPERBYTE)
+    {
+      olen-=BITSPERBYTE;
+      outbuf[hw_fixoutpos++]=o>>olen;
+    }
+
+    o&=((1<<olen)-1);
+  }
+
+  // Then a byte at a time
+  for (; inpos<inlen; inpos++)
+  {
+    // Stop on output buffer overflow
+    if (hw_fixoutpos>=outlen) break;
+
+    o=(o<<HW_FIXSAMPLES)|HW_FIXBYTE(inbuf[inpos]);
+    olen+=HW_FIXSAMPLES;
+
+    while (olen>=BITSPERBYTE)
+    {
+      olen-=BITSPERBYTE;
+
+      if (hw_fixoutpos<outlen)
+        outbuf[hw_fixoutpos++]=o>>olen;
+    }
+
+    o&=((1<<olen)-1);
+  }
+
+  hw_fixo=o; hw_fixolen=olen;
+}
+
+// Fix SPI sample buffer timings
+void hw_fixspisamples(unsigned char *inbuf, long inlen, unsigned char *outbuf, long outlen)
+{
+  hw_fixspireset();
+  hw_fixspiblock(inbuf, inlen, outbuf, outlen);
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hardware.h"
+#include "flux.h"
+
+Flux_List flux_list;
+
+// Make room for level changes, growing the list when needed
+int flux_grow(Flux_List *flux, const unsigned long size)
+{
+  uint32_t *newedges;
+
+  newedges=realloc(flux->edges, size*sizeof(uint32_t));
+  if (newedges==NULL)
+    return 0;
+
+  flux->edges=newedges;
+  flux->size=size;
+
+  return 1;
+}
+
+// Allocate room for the level changes expected in a sample buffer
+int flux_init(Flux_List *flux, const unsigned long buffsize)
+{
+  return flux_grow(flux, buffsize*FLUX_EDGESPERBYTE);
+}
+
+// Start finding level changes in a new set of sample data
+void flux_start(Flux_List *flux, const unsigned char *sampledata)
+{
+  flux->sampledata=sampledata;
+  flux->scanned=0;
+  flux->count=0;
+  flux->generation++;
+
+  // The first sample sets the starting level, so is never an edge
+  flux->level=(sampledata[0]&0x80)>>7;
+  flux->firstrising=(flux->level==0)?0:1;
+}
+
+// Find level changes in the sample data up to the available position
+//   samples are scanned a word at a time, comparing each sample with the one before,
+//   then the position of each change is found by counting leading zeroes
+void flux_extend(Flux_List *flux, const unsigned long available)
+{
+  const unsigned char *sampledata=flux->sampledata;
+  unsigned long scanned=flux->scanned;
+  unsigned long count=flux->count;
+  uint64_t level=flux->level;
+
+  while (scanned<available)
+  {
+    uint64_t word, changes;
+    unsigned int bytes, bits;
+    uint32_t *edges;
+
+    bytes=available-scanned;
+    if (bytes>sizeof(word)) bytes=sizeof(word);
+    bits=bytes*BITSPERBYTE;
+
+    // Load samples into the top of the word, first sample in the most significant bit
+    if (bytes==sizeof(word))
+    {
+      memcpy(&word, &sampledata[scanned], sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      word=__builtin_bswap64(word);
+#endif
+    }
+    else
+    {
+      unsigned int i;
+
+      word=0;
+      for (i=0; i<bytes; i++)
+        word|=((uint64_t)sampledata[scanned+i])<<(56-(i*BITSPERBYTE));
+    }
+
+    // Mark samples which differ from the one before
+    changes=word^((word>>1)|(level<<63));
+    if (bits<64)
+      changes&=(~(uint64_t)0)<<(64-bits);
+
+    if ((count+bits)>flux->size)
+    {
+      // Make sure there's room for the worst case, every sample of this word changing
+      if (!flux_grow(flux, (flux->size*2)+bits))
+        break;
+    }
+
+    edges=flux->edges;
+
+    while (changes!=0)
+    {
+      unsigned int bit;
+
+      bit=__builtin_clzll(changes);
+      edges[count++]=(scanned*BITSPERBYTE)+bit;
+
+      changes&=~(((uint64_t)1<<63)>>bit);
+    }
+
+    level=(word>>(64-bits))&1;
+    scanned+=bytes;
+  }
+
+  flux->scanned=scanned;
+  flux->count=count;
+  flux->level=level;
+}
+
+// Find all the level changes in a set of sample data
+void flux_build(Flux_List *flux, const unsigned char *sampledata, const unsigned long samplesize)
+{
+  flux_start(flux, sampledata);
+  flux_extend(flux, samplesize);
+}
+
+// Free the level change list
+void flux_done(Flux_List *flux)
+{
+  free(flux->edges);
+
+  flux->edges=NULL;
+  flux->size=0;
+  flux->count=0;
+  flux->sampledata=NULL;
+  flux->scanned=0;
+}
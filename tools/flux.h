@@ -0,0 +1,39 @@
+#ifndef _FLUX_H_
+#define _FLUX_H_
+
+#include <stdint.h>
+
+// Initial number of level changes to allow room for, per byte of sample data
+#define FLUX_EDGESPERBYTE 1
+
+typedef struct FluxList
+{
+  // Sample data the level changes were found in
+  const unsigned char *sampledata;
+  unsigned long scanned;
+
+  // Sample positions of each level change, alternating between rising and falling edges
+  uint32_t *edges;
+  unsigned long count;
+  unsigned long size;
+
+  // Index of the first rising edge within edges, each subsequent rising edge is 2 further on
+  unsigned long firstrising;
+
+  // Level of the last sample scanned
+  uint64_t level;
+
+  // Incremented each time the list is started on new sample data, so users of the list can tell it has been restarted
+  unsigned long generation;
+} Flux_List;
+
+// Level changes for the sample data being processed
+extern Flux_List flux_list;
+
+extern int flux_init(Flux_List *flux, const unsigned long buffsize);
+extern void flux_start(Flux_List *flux, const unsigned char *sampledata);
+extern void flux_extend(Flux_List *flux, const unsigned long available);
+extern void flux_build(Flux_List *flux, const unsigned char *sampledata, const unsigned long samplesize);
+extern void flux_done(Flux_List *flux);
+
+#endif
@@ -2,336 +2,360 @@
 
 #include "crc.h"
 #include "diskstore.h"
+#include "fusion.h"
 #include "dfs.h"
 #include "mod.h"
 #include "fm.h"
 #include "hardware.h"
 #include "pll.h"
 
-int fm_state=FM_SYNC; // state machine
-unsigned int fm_datacells=0; // 16 bit sliding buffer
-int fm_bits=0; // Number of used bits within sliding buffer
-unsigned int fm_p1, fm_p2, fm_p3=0;
-
-// Most recent address mark
-unsigned long fm_idpos, fm_blockpos;
-int fm_idamtrack, fm_idamhead, fm_idamsector, fm_idamlength; // IDAM values
-int fm_lasttrack, fm_lasthead, fm_lastsector, fm_lastlength;
-unsigned char fm_blocktype;
-unsigned int fm_blocksize;
-unsigned int fm_idblockcrc, fm_datablockcrc, fm_bitstreamcrc;
-
-// Output block data buffer, for a single sector
-unsigned char fm_bitstream[FM_BLOCKSIZE];
-unsigned int fm_bitlen=0;
-
-// FM timings
-float fm_defaultwindow;
-float fm_bucket1, fm_bucket01;
-
-struct PLL *fm_pll;
-
-int fm_debug=0;
-
 // Validate clock bits
 int fm_validateclock(const unsigned char clock)
 {
   return (clock==0xff);
 }
 
-// Add a bit to the 16-bit accumulator, when full - attempt to process (clock + data)
-void fm_addbit(const unsigned char bit, const unsigned long datapos)
+// Add a byte to the block, bringing the CRC up to date with the byte two before it
+//   so once the block is complete the CRC covers everything but the CRC bytes on the end
+void fm_addbyte(FM_Context *fm, const unsigned char data)
 {
-  // Maintain previous 48 bits of data
-  fm_p1=(fm_p1<<1)|((fm_p2&0x8000)>>15);
-  fm_p2=(fm_p2<<1)|((fm_p3&0x8000)>>15);
-  fm_p3=(fm_p3<<1)|((fm_datacells&0x8000)>>15);
+  if (fm->bitlen>=2)
+    fm->blockcrc=CRC_ADDBYTE(fm->crctable, (fm->bitlen==2)?CRC_CCITT_INITIAL:fm->blockcrc, fm->bitstream[fm->bitlen-2]);
+
+  fm->bitstream[fm->bitlen++]=data;
+}
+
+// Process the 16-bit accumulator (clock + data)
+void fm_processcells(FM_Context *fm, const unsigned long datapos)
+{
+  unsigned char clock, data;
+
+  // Extract clock byte, for data this should be 0xff
+  clock=MOD_GETCLOCK(fm->datacells);
 
-  fm_datacells=((fm_datacells<<1)&0xffff);
-  fm_datacells|=bit;
-  fm_bits++;
+  // Extract data byte
+  data=MOD_GETDATA(fm->datacells);
 
-  // Keep processing until we have 8 clock bits + 8 data bits
-  if (fm_bits>=16)
+  switch (fm->state)
   {
-    unsigned char clock, data;
+    unsigned char dataCRC; // EDC
+
+    case FM_SYNC:
+      // Detect standard FM address marks
+      switch (fm->datacells)
+      {
+        case 0xf77a: // clock=d7 data=fc
+          if (fm->debug)
+            fprintf(stderr, "\n[%lx] FM Index Address Mark\n", datapos);
+          fm->blocktype=data;
+          fm->bitlen=0;
+          fm->state=FM_SYNC;
+
+          // Clear IDAM cache, although I've not seen IAM on Acorn DFS
+          fm->idpos=0;
+          fm->idamtrack=-1;
+          fm->idamhead=-1;
+          fm->idamsector=-1;
+          fm->idamlength=-1;
+          break;
+
+        case 0xf57e: // clock=c7 data=fe
+          if (fm->debug)
+            fprintf(stderr, "\n[%lx] FM ID Address Mark\n", datapos);
+          fm->blocktype=data;
+          fm->blocksize=6+1;
+          fm->bitlen=0;
+          fm_addbyte(fm, data);
+          fm->idpos=datapos;
+          fm->state=FM_ADDR;
+
+          // Clear IDAM cache incase previous was good and this one is bad
+          fm->idamtrack=-1;
+          fm->idamhead=-1;
+          fm->idamsector=-1;
+          fm->idamlength=-1;
+          break;
+
+        case 0xf56f: // clock=c7 data=fb
+          if (fm->debug)
+            fprintf(stderr, "\n[%lx] FM Data Address Mark, distance from ID %lx\n", datapos, datapos-fm->idpos);
+
+          // Don't process if don't have a valid preceding IDAM
+          if ((fm->idamtrack!=-1) && (fm->idamhead!=-1) && (fm->idamsector!=-1) && (fm->idamlength!=-1))
+          {
+            fm->blocktype=data;
+            fm->bitlen=0;
+            fm_addbyte(fm, data);
+            fm->blockpos=datapos;
+            fm->state=FM_DATA;
+          }
+          else
+          {
+            fm->blocktype=FM_BLOCKNULL;
+            fm->bitlen=0;
+            fm->state=FM_SYNC;
+          }
+          break;
 
-    // Extract clock byte, for data this should be 0xff
-    clock=mod_getclock(fm_datacells);
+        case 0xf56a: // clock=c7 data=f8
+          if (fm->debug)
+            fprintf(stderr, "\n[%lx] FM Deleted Data Address Mark, distance from ID %lx\n", datapos, datapos-fm->idpos);
 
-    // Extract data byte
-    data=mod_getdata(fm_datacells);
+          // Don't process if don't have a valid preceding IDAM
+          if ((fm->idamtrack!=-1) && (fm->idamhead!=-1) && (fm->idamsector!=-1) && (fm->idamlength!=-1))
+          {
+            fm->blocktype=data;
+            fm->bitlen=0;
+            fm_addbyte(fm, data);
+            fm->blockpos=datapos;
+            fm->state=FM_DATA;
+          }
+          else
+          {
+            fm->blocktype=FM_BLOCKNULL;
+            fm->bitlen=0;
+            fm->state=FM_SYNC;
+          }
+          break;
 
-    switch (fm_state)
-    {
-      unsigned char dataCRC; // EDC
+        default:
+          // No matching address marks
+          break;
+      }
+      break;
 
-      case FM_SYNC:
-        // Detect standard FM address marks
-        switch (fm_datacells)
-        {
-          case 0xf77a: // clock=d7 data=fc
-            if (fm_debug)
-              fprintf(stderr, "\n[%lx] FM Index Address Mark\n", datapos);
-            fm_blocktype=data;
-            fm_bitlen=0;
-            fm_state=FM_SYNC;
-
-            // Clear IDAM cache, although I've not seen IAM on Acorn DFS
-            fm_idpos=0;
-            fm_idamtrack=-1;
-            fm_idamhead=-1;
-            fm_idamsector=-1;
-            fm_idamlength=-1;
-            break;
-
-          case 0xf57e: // clock=c7 data=fe
-            if (fm_debug)
-              fprintf(stderr, "\n[%lx] FM ID Address Mark\n", datapos);
-            fm_blocktype=data;
-            fm_blocksize=6+1;
-            fm_bitlen=0;
-            fm_bitstream[fm_bitlen++]=data;
-            fm_idpos=datapos;
-            fm_state=FM_ADDR;
-
-            // Clear IDAM cache incase previous was good and this one is bad
-            fm_idamtrack=-1;
-            fm_idamhead=-1;
-            fm_idamsector=-1;
-            fm_idamlength=-1;
-            break;
-
-          case 0xf56f: // clock=c7 data=fb
-            if (fm_debug)
-              fprintf(stderr, "\n[%lx] FM Data Address Mark, distance from ID %lx\n", datapos, datapos-fm_idpos);
-
-            // Don't process if don't have a valid preceding IDAM
-            if ((fm_idamtrack!=-1) && (fm_idamhead!=-1) && (fm_idamsector!=-1) && (fm_idamlength!=-1))
-            {
-              fm_blocktype=data;
-              fm_bitlen=0;
-              fm_bitstream[fm_bitlen++]=data;
-              fm_blockpos=datapos;
-              fm_state=FM_DATA;
-            }
-            else
-            {
-              fm_blocktype=FM_BLOCKNULL;
-              fm_bitlen=0;
-              fm_state=FM_SYNC;
-            }
-            break;
-
-          case 0xf56a: // clock=c7 data=f8
-            if (fm_debug)
-              fprintf(stderr, "\n[%lx] FM Deleted Data Address Mark, distance from ID %lx\n", datapos, datapos-fm_idpos);
-
-            // Don't process if don't have a valid preceding IDAM
-            if ((fm_idamtrack!=-1) && (fm_idamhead!=-1) && (fm_idamsector!=-1) && (fm_idamlength!=-1))
-            {
-              fm_blocktype=data;
-              fm_bitlen=0;
-              fm_bitstream[fm_bitlen++]=data;
-              fm_blockpos=datapos;
-              fm_state=FM_DATA;
-            }
-            else
-            {
-              fm_blocktype=FM_BLOCKNULL;
-              fm_bitlen=0;
-              fm_state=FM_SYNC;
-            }
-            break;
-
-          default:
-            // No matching address marks
-            break;
-        }
-        break;
+    case FM_ADDR:
+      // Keep reading until we have the whole block in fm->bitstream[]
+      fm_addbyte(fm, data);
 
-      case FM_ADDR:
-        // Keep reading until we have the whole block in fm_bitstream[]
-        fm_bitstream[fm_bitlen++]=data;
+      if (fm->bitlen==fm->blocksize)
+      {
+        fm->idblockcrc=fm->blockcrc;
+        fm->bitstreamcrc=(((unsigned int)fm->bitstream[fm->bitlen-2]<<8)|fm->bitstream[fm->bitlen-1]);
+        dataCRC=(fm->idblockcrc==fm->bitstreamcrc)?GOODDATA:BADDATA;
 
-        if (fm_bitlen==fm_blocksize)
+        if (fm->debug)
         {
-          fm_idblockcrc=calc_crc(&fm_bitstream[0], fm_bitlen-2);
-          fm_bitstreamcrc=(((unsigned int)fm_bitstream[fm_bitlen-2]<<8)|fm_bitstream[fm_bitlen-1]);
-          dataCRC=(fm_idblockcrc==fm_bitstreamcrc)?GOODDATA:BADDATA;
-
-          if (fm_debug)
-          {
-            fprintf(stderr, "[%lx] FM Track %d (%d) ", datapos, fm_bitstream[1], hw_currenttrack);
-            fprintf(stderr, "Head %d (%d) ", fm_bitstream[2], hw_currenthead);
-            fprintf(stderr, "Sector %d ", fm_bitstream[3]);
-            fprintf(stderr, "Data size %d ", fm_bitstream[4]);
-            fprintf(stderr, "CRC %.2x%.2x", fm_bitstream[5], fm_bitstream[6]);
-
-            if (dataCRC==GOODDATA)
-              fprintf(stderr, " OK\n");
-            else
-              fprintf(stderr, " BAD (%.4x)\n", fm_idblockcrc);
-          }
+          fprintf(stderr, "[%lx] FM Track %d (%d) ", datapos, fm->bitstream[1], fm->track);
+          fprintf(stderr, "Head %d (%d) ", fm->bitstream[2], fm->head);
+          fprintf(stderr, "Sector %d ", fm->bitstream[3]);
+          fprintf(stderr, "Data size %d ", fm->bitstream[4]);
+          fprintf(stderr, "CRC %.2x%.2x", fm->bitstream[5], fm->bitstream[6]);
 
           if (dataCRC==GOODDATA)
-          {
-            // Record IDAM values
-            fm_idamtrack=fm_bitstream[1];
-            fm_idamhead=fm_bitstream[2];
-            fm_idamsector=fm_bitstream[3];
-            fm_idamlength=fm_bitstream[4];
-
-            // Record last known good IDAM values for this track
-            fm_lasttrack=fm_idamtrack;
-            fm_lasthead=fm_idamhead;
-            fm_lastsector=fm_idamsector;
-            fm_lastlength=fm_idamlength;
-
-            // Sanitise data block length
-            switch(fm_idamlength)
-            {
-              case 0x00: // 128
-              case 0x01: // 256
-              case 0x02: // 512
-              case 0x03: // 1024
-              case 0x04: // 2048
-              case 0x05: // 4096
-              case 0x06: // 8192
-              case 0x07: // 16384
-                fm_blocksize=(128<<fm_idamlength)+3;
-                break;
-
-              default:
-                if (fm_debug)
-                  fprintf(stderr, "Invalid record length %.2x\n", fm_idamlength);
-
-                // Default to DFS standard sector size + (fm_blocktype + (2 x crc))
-                fm_blocksize=DFS_SECTORSIZE+3;
-                break;
-            }
-          }
+            fprintf(stderr, " OK\n");
           else
+            fprintf(stderr, " BAD (%.4x)\n", fm->idblockcrc);
+        }
+
+        if (dataCRC==GOODDATA)
+        {
+          // Record IDAM values
+          fm->idamtrack=fm->bitstream[1];
+          fm->idamhead=fm->bitstream[2];
+          fm->idamsector=fm->bitstream[3];
+          fm->idamlength=fm->bitstream[4];
+
+          // Record last known good IDAM values for this track
+          fm->lasttrack=fm->idamtrack;
+          fm->lasthead=fm->idamhead;
+          fm->lastsector=fm->idamsector;
+          fm->lastlength=fm->idamlength;
+
+          // Sanitise data block length
+          switch(fm->idamlength)
           {
-            // IDAM failed CRC, ignore following data block (for now)
-            fm_blocksize=0;
-
-            // Clear IDAM cache
-            fm_idpos=0;
-            fm_idamtrack=-1;
-            fm_idamhead=-1;
-            fm_idamsector=-1;
-            fm_idamlength=-1;
+            case 0x00: // 128
+            case 0x01: // 256
+            case 0x02: // 512
+            case 0x03: // 1024
+            case 0x04: // 2048
+            case 0x05: // 4096
+            case 0x06: // 8192
+            case 0x07: // 16384
+              fm->blocksize=(128<<fm->idamlength)+3;
+              break;
+
+            default:
+              if (fm->debug)
+                fprintf(stderr, "Invalid record length %.2x\n", fm->idamlength);
+
+              // Default to DFS standard sector size + (fm->blocktype + (2 x crc))
+              fm->blocksize=DFS_SECTORSIZE+3;
+              break;
           }
-
-          fm_state=FM_SYNC;
-          fm_blocktype=FM_BLOCKNULL;
         }
-        break;
+        else
+        {
+          // IDAM failed CRC, ignore following data block (for now)
+          fm->blocksize=0;
+
+          // Clear IDAM cache
+          fm->idpos=0;
+          fm->idamtrack=-1;
+          fm->idamhead=-1;
+          fm->idamsector=-1;
+          fm->idamlength=-1;
+        }
 
-      case FM_DATA:
-        // Validate clock bits
-        if (fm_debug)
-          fm_validateclock(clock);
+        fm->state=FM_SYNC;
+        fm->blocktype=FM_BLOCKNULL;
+      }
+      break;
 
-        // Keep reading until we have the whole block in fm_bitstream[]
-        fm_bitstream[fm_bitlen++]=data;
+    case FM_DATA:
+      // Validate clock bits
+      if (fm->debug)
+        fm_validateclock(clock);
 
-        if (fm_bitlen==fm_blocksize)
-        {
-          // All the bytes for this "data" block have been read, so process them
+      // Keep reading until we have the whole block in fm->bitstream[]
+      fm_addbyte(fm, data);
 
-          // Calculate CRC (EDC)
-          fm_datablockcrc=calc_crc(&fm_bitstream[0], fm_bitlen-2);
-          fm_bitstreamcrc=(((unsigned int)fm_bitstream[fm_bitlen-2]<<8)|fm_bitstream[fm_bitlen-1]);
+      if (fm->bitlen==fm->blocksize)
+      {
+        // All the bytes for this "data" block have been read, so process them
 
-          if (fm_debug)
-            fprintf(stderr, "  %.2x CRC %.4x", fm_blocktype, fm_bitstreamcrc);
+        // Calculate CRC (EDC)
+        fm->datablockcrc=fm->blockcrc;
+        fm->bitstreamcrc=(((unsigned int)fm->bitstream[fm->bitlen-2]<<8)|fm->bitstream[fm->bitlen-1]);
 
-          dataCRC=(fm_datablockcrc==fm_bitstreamcrc)?GOODDATA:BADDATA;
+        if (fm->debug)
+          fprintf(stderr, "  %.2x CRC %.4x", fm->blocktype, fm->bitstreamcrc);
 
-          // Report and save if the CRC matches
-          if (dataCRC==GOODDATA)
-          {
-            if (fm_debug)
-              fprintf(stderr, " OK [%lx]\n", datapos);
-
-            if (diskstore_addsector(MODFM, hw_currenttrack, hw_currenthead, fm_idamtrack, fm_idamhead, fm_idamsector, fm_idamlength, fm_idpos, fm_idblockcrc, fm_blockpos, fm_blocktype, fm_blocksize-3, &fm_bitstream[1], fm_datablockcrc)==1)
-            {
-              if (fm_debug)
-                fprintf(stderr, "** FM new sector T%d H%d - C%d H%d R%d N%d - IDCRC %.4x DATACRC %.4x **\n", hw_currenttrack, hw_currenthead, fm_idamtrack, fm_idamhead, fm_idamsector, fm_idamlength, fm_idblockcrc, fm_datablockcrc);
-            }
-          }
-          else
+        dataCRC=(fm->datablockcrc==fm->bitstreamcrc)?GOODDATA:BADDATA;
+
+        // Report and save if the CRC matches
+        if (dataCRC==GOODDATA)
+        {
+          if (fm->debug)
+            fprintf(stderr, " OK [%lx]\n", datapos);
+
+          if (diskstore_addsector(MODFM, fm->track, fm->head, fm->idamtrack, fm->idamhead, fm->idamsector, fm->idamlength, fm->idpos, fm->idblockcrc, fm->blockpos, datapos, fm->blocktype, fm->blocksize-3, &fm->bitstream[1], fm->datablockcrc)==1)
           {
-            if (fm_debug)
-              fprintf(stderr, " BAD (%.4x)\n", fm_datablockcrc);
+            if (fm->debug)
+              fprintf(stderr, "** FM new sector T%d H%d - C%d H%d R%d N%d - IDCRC %.4x DATACRC %.4x **\n", fm->track, fm->head, fm->idamtrack, fm->idamhead, fm->idamsector, fm->idamlength, fm->idblockcrc, fm->datablockcrc);
           }
+        }
+        else
+        {
+          if (fm->debug)
+            fprintf(stderr, " BAD (%.4x)\n", fm->datablockcrc);
 
-          // Require subsequent data blocks to have a valid ID block first
-          fm_idpos=0;
-          fm_idamtrack=-1;
-          fm_idamhead=-1;
-          fm_idamsector=-1;
-          fm_idamlength=-1;
-
-          fm_blocktype=FM_BLOCKNULL;
-          fm_blocksize=0;
-          fm_state=FM_SYNC;
+          // Keep bad copies following a good IDAM, in case enough of them can be fused into a good one
+          if (fm->idamtrack!=-1)
+            fusion_addcopy(MODFM, fm->track, fm->head, fm->idamtrack, fm->idamhead, fm->idamsector, fm->idamlength, fm->idpos, fm->idblockcrc, fm->blockpos, datapos, &fm->bitstream[0], fm->bitlen, 1, fm->blocksize-3);
         }
-        break;
 
-      default:
-        // Unknown state, should never happen
-        fm_blocktype=FM_BLOCKNULL;
-        fm_blocksize=0;
-        fm_state=FM_SYNC;
-        break;
-    }
+        // Require subsequent data blocks to have a valid ID block first
+        fm->idpos=0;
+        fm->idamtrack=-1;
+        fm->idamhead=-1;
+        fm->idamsector=-1;
+        fm->idamlength=-1;
+
+        fm->blocktype=FM_BLOCKNULL;
+        fm->blocksize=0;
+        fm->state=FM_SYNC;
+      }
+      break;
+
+    default:
+      // Unknown state, should never happen
+      fm->blocktype=FM_BLOCKNULL;
+      fm->blocksize=0;
+      fm->state=FM_SYNC;
+      break;
+  }
 
-    // If waiting for sync, then keep width at 16 bits and continue shifting/adding new bits
-    if (fm_state==FM_SYNC)
-      fm_bits=16;
-    else
-      fm_bits=0;
+  // If waiting for sync, then keep width at 16 bits and continue shifting/adding new bits
+  if (fm->state==FM_SYNC)
+    fm->bits=16;
+  else
+    fm->bits=0;
+}
+
+// Add bits to the 16-bit accumulator, most significant first, processing whenever 8 clock bits + 8 data bits are held
+void fm_addbits(FM_Context *fm, const unsigned int bits, const unsigned int count, const unsigned long datapos)
+{
+  unsigned int remaining, n;
+
+  remaining=count;
+
+  while (remaining>0)
+  {
+    // Take as many bits as fit before the accumulator next needs processing
+    n=(fm->bits<16)?(16-fm->bits):1;
+    if (n>remaining) n=remaining;
+
+    remaining-=n;
+    fm->datacells=((fm->datacells<<n)|((bits>>remaining)&((1<<n)-1)))&0xffff;
+    fm->bits+=n;
+
+    if (fm->bits>=16)
+    {
+      // Whilst waiting for sync, only possible address marks need processing
+      if ((fm->state==FM_SYNC) && ((fm->datacells&0xfd00)!=0xf500))
+        fm->bits=16;
+      else
+        fm_processcells(fm, datapos);
+    }
   }
 }
 
-void fm_addsample(const unsigned long samples, const unsigned long datapos, const int usepll)
+// Add a single bit, as recovered by the PLL
+void fm_addbit(FM_Context *fm, const unsigned char bit, const unsigned long datapos)
 {
+  fm_addbits(fm, bit, 1, datapos);
+}
+
+void fm_addsample(FM_Context *fm, const unsigned long samples, const unsigned long datapos, const int usepll)
+{
+  unsigned int cells;
+
   if (usepll)
   {
-    PLL_addsample(fm_pll, samples, datapos);
+    PLL_addsample(fm->pll, samples, datapos);
 
     return;
   }
 
-  // Does number of samples fit within "1" bucket ..
-  if (samples<=fm_bucket1)
-  {
-    fm_addbit(1, datapos);
-  }
-  else // .. does number of samples fit within "01" bucket
-  if (samples<=fm_bucket01)
-  {
-   fm_addbit(0, datapos);
-   fm_addbit(1, datapos);
-  }
-  else
+  // Which of "1", "01" or "001" the number of samples fits, the last shouldn't happen in single-density FM encoding
+  cells=BUCKET_CELLS(&fm->buckets, samples);
+
+  // Whilst waiting for sync, skip the state machine unless an address mark could complete within these cells
+  if ((fm->state==FM_SYNC) && (fm->bits>=16))
   {
-    // TODO This shouldn't happen in single-density FM encoding
-   fm_addbit(0, datapos);
-   fm_addbit(0, datapos);
-   fm_addbit(1, datapos);
+    unsigned int window, i;
+
+    window=(fm->datacells<<cells)|0x1;
+
+    for (i=0; i<cells; i++)
+      if (((window>>i)&0xfd00)==0xf500)
+        break;
+
+    if (i==cells)
+    {
+      fm->datacells=window&0xffff;
+
+      return;
+    }
   }
+
+  fm_addbits(fm, 0x1, cells, datapos);
 }
 
 // Initialise the FM parser
-void fm_init(const int debug, const char density)
+void fm_init(FM_Context *fm, const int debug, const char density, const uint8_t track, const uint8_t head, const float rpm)
 {
   float bitcell=FM_BITCELL;
+  float limits[2];
+
+  fm->debug=debug;
 
-  fm_debug=debug;
+  // Record where the sample data came from
+  fm->track=track;
+  fm->head=head;
+  fm->rpm=rpm;
 
   if ((density&MOD_DENSITYFMSD)==0)
   {
@@ -339,51 +363,51 @@ void fm_init(const int debug, const char density)
   }
 
   // Adjust bitcell for RPM
-  bitcell=(bitcell/(float)HW_DEFAULTRPM)*hw_rpm;
+  bitcell=(bitcell/(float)HW_DEFAULTRPM)*fm->rpm;
 
   // Determine number of samples between "1" pulses (default window)
-  fm_defaultwindow=((float)hw_samplerate/(float)USINSECOND)*bitcell;
+  fm->defaultwindow=((float)hw_samplerate/(float)USINSECOND)*bitcell;
 
-  if (fm_pll!=NULL)
-    PLL_reset(fm_pll, fm_defaultwindow);
+  if (fm->pll!=NULL)
+    PLL_reset(fm->pll, fm->defaultwindow);
   else
-    fm_pll=PLL_create(fm_defaultwindow, fm_addbit);
+    fm->pll=PLL_create(fm->defaultwindow, fm_addbit, fm);
 
   // From default window, determine bucket sizes for assigning bits "1" or "01"
-  fm_bucket1=fm_defaultwindow+(fm_defaultwindow/2);
-  fm_bucket01=(fm_defaultwindow*2)+(fm_defaultwindow/2);
+  fm->bucket1=fm->defaultwindow+(fm->defaultwindow/2);
+  fm->bucket01=(fm->defaultwindow*2)+(fm->defaultwindow/2);
 
-  // Set up FM parser
-  fm_state=FM_SYNC;
-  fm_datacells=0;
-  fm_bits=0;
+  limits[0]=fm->bucket1;
+  limits[1]=fm->bucket01;
+  bucket_build(&fm->buckets, limits, 2, 1);
 
-  fm_idpos=0;
-  fm_blockpos=0;
+  // Set up FM parser
+  fm->state=FM_SYNC;
+  fm->datacells=0;
+  fm->bits=0;
 
-  fm_blocktype=FM_BLOCKNULL;
-  fm_blocksize=0;
+  fm->idpos=0;
+  fm->blockpos=0;
 
-  fm_idblockcrc=0;
-  fm_datablockcrc=0;
-  fm_bitstreamcrc=0;
+  fm->blocktype=FM_BLOCKNULL;
+  fm->blocksize=0;
 
-  fm_bitlen=0;
+  fm->idblockcrc=0;
+  fm->datablockcrc=0;
+  fm->bitstreamcrc=0;
 
-  // Initialise previous data cache
-  fm_p1=0;
-  fm_p2=0;
-  fm_p3=0;
+  fm->bitlen=0;
+  fm->crctable=calc_crc_table(CRC_CCITT_POLYNOMIAL);
 
   // Initialise last found sector IDAM to invalid
-  fm_idamtrack=-1;
-  fm_idamhead=-1;
-  fm_idamsector=-1;
-  fm_idamlength=-1;
+  fm->idamtrack=-1;
+  fm->idamhead=-1;
+  fm->idamsector=-1;
+  fm->idamlength=-1;
 
   // Initialise last known good sector IDAM to invalid
-  fm_lasttrack=-1;
-  fm_lasthead=-1;
-  fm_lastsector=-1;
-  fm_lastlength=-1;
+  fm->lasttrack=-1;
+  fm->lasthead=-1;
+  fm->lastsector=-1;
+  fm->lastlength=-1;
 }
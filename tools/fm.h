@@ -1,6 +1,11 @@
 #ifndef _FM_H_
 #define _FM_H_
 
+#include <stdint.h>
+
+#include "bucket.h"
+#include "crc.h"
+
 // Microseconds in a bitcell window for single-density FM at 300 RPM
 #define FM_BITCELL 4
 
@@ -23,11 +28,45 @@
 #define FM_ADDR 2
 #define FM_DATA 3
 
-extern int fm_idamtrack, fm_idamhead, fm_idamsector, fm_idamlength;
-extern int fm_lasttrack, fm_lasthead, fm_lastsector, fm_lastlength;
+typedef struct FMContext
+{
+  // Physical position and speed the sample data was captured with
+  uint8_t track;
+  uint8_t head;
+  float rpm;
+
+  int state; // state machine
+  unsigned int datacells; // 16 bit sliding buffer
+  int bits; // Number of used bits within sliding buffer
+
+  // Most recent address mark
+  unsigned long idpos, blockpos;
+  int idamtrack, idamhead, idamsector, idamlength; // IDAM values
+  int lasttrack, lasthead, lastsector, lastlength; // last known good IDAM values
+  unsigned char blocktype;
+  unsigned int blocksize;
+  unsigned int idblockcrc, datablockcrc, bitstreamcrc;
+
+  // Output block data buffer, for a single sector
+  unsigned char bitstream[FM_BLOCKSIZE];
+  unsigned int bitlen;
+
+  // CRC of all but the last two bytes of the block so far, kept up to date as bytes arrive
+  const CRC_Table *crctable;
+  uint16_t blockcrc;
+
+  // FM timings
+  float defaultwindow;
+  float bucket1, bucket01;
+  Bucket_Table buckets;
+
+  struct PLL *pll;
+
+  int debug;
+} FM_Context;
 
-extern void fm_addsample(const unsigned long samples, const unsigned long datapos, const int usepll);
+extern void fm_addsample(FM_Context *fm, const unsigned long samples, const unsigned long datapos, const int usepll);
 
-extern void fm_init(const int debug, const char density);
+extern void fm_init(FM_Context *fm, const int debug, const char density, const uint8_t track, const uint8_t head, const float rpm);
 
 #endif
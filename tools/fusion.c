@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc.h"
+#include "diskstore.h"
+#include "fusion.h"
+
+// Linked list of sectors only seen with bad data so far
+Fusion_Sector *Fusion_SectorsRoot=NULL;
+
+unsigned int fusion_recovered=0;
+
+int fusion_debug=0;
+
+// Guards the sector list, as copies may be added by several decoding threads
+pthread_mutex_t fusion_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// Find the entry for a sector, by where it was found and its IDAM
+Fusion_Sector *fusion_findsector(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const unsigned int idcrc, const unsigned int blocksize)
+{
+  Fusion_Sector *curr;
+
+  curr=Fusion_SectorsRoot;
+
+  while (curr!=NULL)
+  {
+    if ((curr->modulation==modulation) &&
+        (curr->physical_track==physical_track) &&
+        (curr->physical_head==physical_head) &&
+        (curr->logical_track==logical_track) &&
+        (curr->logical_head==logical_head) &&
+        (curr->logical_sector==logical_sector) &&
+        (curr->logical_size==logical_size) &&
+        (curr->idcrc==idcrc) &&
+        (curr->blocksize==blocksize))
+      return curr;
+
+    curr=curr->next;
+  }
+
+  return NULL;
+}
+
+// Keep a copy of a data block which failed its CRC, following a good IDAM
+void fusion_addcopy(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const long id_pos, const unsigned int idcrc, const long data_pos, const long data_endpos, const unsigned char *block, const unsigned int blocksize, const unsigned int dataoffset, const unsigned int datasize)
+{
+  Fusion_Sector *sector;
+  unsigned char *copy;
+  unsigned int i;
+
+  // Needs at least a block type and CRC
+  if ((blocksize<3) || (dataoffset==0) || (datasize>blocksize) || ((dataoffset+datasize+2)>blocksize))
+    return;
+
+  pthread_mutex_lock(&fusion_lock);
+
+  sector=fusion_findsector(modulation, physical_track, physical_head, logical_track, logical_head, logical_sector, logical_size, idcrc, blocksize);
+
+  if (sector==NULL)
+  {
+    sector=malloc(sizeof(Fusion_Sector));
+    if (sector==NULL)
+    {
+      pthread_mutex_unlock(&fusion_lock);
+      return;
+    }
+
+    sector->modulation=modulation;
+    sector->physical_track=physical_track;
+    sector->physical_head=physical_head;
+
+    sector->id_pos=id_pos;
+    sector->logical_track=logical_track;
+    sector->logical_head=logical_head;
+    sector->logical_sector=logical_sector;
+    sector->logical_size=logical_size;
+    sector->idcrc=idcrc;
+
+    sector->data_pos=data_pos;
+    sector->data_endpos=data_endpos;
+    sector->blocksize=blocksize;
+    sector->dataoffset=dataoffset;
+    sector->datasize=datasize;
+
+    sector->copycount=0;
+    sector->capturestart=0;
+    sector->recovered=0;
+
+    sector->next=Fusion_SectorsRoot;
+    Fusion_SectorsRoot=sector;
+  }
+
+  if (sector->recovered)
+  {
+    pthread_mutex_unlock(&fusion_lock);
+    return;
+  }
+
+  // Buckets and PLL decoding the same capture both read the same flux, so only count as one vote
+  //   the later decode replaces the earlier one, which is the PLL as it runs behind or after the buckets
+  for (i=sector->capturestart; i<sector->copycount; i++)
+  {
+    if ((data_pos<(long)sector->copyendpos[i]) && ((long)sector->copypos[i]<data_endpos))
+    {
+      memcpy(sector->copies[i], block, blocksize);
+      sector->copypos[i]=data_pos;
+      sector->copyendpos[i]=data_endpos;
+
+      pthread_mutex_unlock(&fusion_lock);
+      return;
+    }
+  }
+
+  // Once enough copies are kept, more won't change the vote
+  if (sector->copycount>=FUSION_MAXCOPIES)
+  {
+    pthread_mutex_unlock(&fusion_lock);
+    return;
+  }
+
+  copy=malloc(blocksize);
+  if (copy!=NULL)
+  {
+    memcpy(copy, block, blocksize);
+    sector->copies[sector->copycount]=copy;
+    sector->copypos[sector->copycount]=data_pos;
+    sector->copyendpos[sector->copycount]=data_endpos;
+    sector->copycount++;
+  }
+
+  pthread_mutex_unlock(&fusion_lock);
+}
+
+// Vote on each bit of the block across all copies, then flip the least certain bits until the CRC matches
+//   returns number of bits flipped, or -1 if no unique match was found
+int fusion_fuse(const Fusion_Sector *sector, unsigned char *block)
+{
+  unsigned int flipbyte[FUSION_MAXFLIPS];
+  unsigned char flipmask[FUSION_MAXFLIPS];
+  unsigned int flipmargin[FUSION_MAXFLIPS];
+  uint16_t syndrome[FUSION_MAXFLIPS];
+  unsigned int flips=0;
+  unsigned int crclen=sector->blocksize-2;
+  unsigned int pos, combo, found, matches;
+  uint16_t residual;
+  unsigned char *single;
+  int bit, flipped;
+
+  for (pos=0; pos<sector->blocksize; pos++)
+  {
+    block[pos]=0;
+
+    for (bit=7; bit>=0; bit--)
+    {
+      unsigned char mask=(1<<bit);
+      unsigned int ones=0;
+      unsigned int margin;
+      unsigned int i;
+
+      for (i=0; i<sector->copycount; i++)
+        if ((sector->copies[i][pos]&mask)!=0)
+          ones++;
+
+      // Ties go with the first copy seen
+      if (((ones*2)>sector->copycount) || (((ones*2)==sector->copycount) && ((sector->copies[0][pos]&mask)!=0)))
+        block[pos]|=mask;
+
+      // Copies which all agree are taken as certain
+      margin=((ones*2)>sector->copycount)?((ones*2)-sector->copycount):(sector->copycount-(ones*2));
+      if (margin==sector->copycount)
+        continue;
+
+      // Keep the least certain bits, in order of certainty
+      for (i=flips; i>0; i--)
+      {
+        if (flipmargin[i-1]<=margin)
+          break;
+
+        if (i<FUSION_MAXFLIPS)
+        {
+          flipbyte[i]=flipbyte[i-1];
+          flipmask[i]=flipmask[i-1];
+          flipmargin[i]=flipmargin[i-1];
+        }
+      }
+
+      if (i<FUSION_MAXFLIPS)
+      {
+        flipbyte[i]=pos;
+        flipmask[i]=mask;
+        flipmargin[i]=margin;
+
+        if (flips<FUSION_MAXFLIPS)
+          flips++;
+      }
+    }
+  }
+
+  residual=calc_crc(block, crclen)^((block[crclen]<<8)|block[crclen+1]);
+  if (residual==0)
+    return 0;
+
+  // CRC is linear, so flipping a bit always changes the residual by the same amount
+  single=calloc(crclen, 1);
+  if (single==NULL)
+    return -1;
+
+  for (bit=0; bit<(int)flips; bit++)
+  {
+    if (flipbyte[bit]<crclen)
+    {
+      single[flipbyte[bit]]=flipmask[bit];
+      syndrome[bit]=calc_crc_stream(single, crclen, 0, CRC_CCITT_POLYNOMIAL);
+      single[flipbyte[bit]]=0;
+    }
+    else
+      syndrome[bit]=(flipbyte[bit]==crclen)?(flipmask[bit]<<8):flipmask[bit];
+  }
+
+  free(single);
+
+  // Try every combination of flips in Gray code order, only trusting a unique match
+  found=0;
+  matches=0;
+  combo=0;
+
+  for (pos=1; pos<(1U<<flips); pos++)
+  {
+    bit=__builtin_ctz(pos);
+
+    combo^=(1<<bit);
+    residual^=syndrome[bit];
+
+    if (residual==0)
+    {
+      found=combo;
+      matches++;
+    }
+  }
+
+  if (matches!=1)
+    return -1;
+
+  flipped=0;
+  for (bit=0; bit<(int)flips; bit++)
+  {
+    if ((found&(1<<bit))!=0)
+    {
+      block[flipbyte[bit]]^=flipmask[bit];
+      flipped++;
+    }
+  }
+
+  return flipped;
+}
+
+// Try to recover sectors still missing from a track by fusing their bad copies
+//   called once each capture of the track has been decoded
+unsigned int fusion_recover(const uint8_t physical_track, const uint8_t physical_head)
+{
+  Fusion_Sector *curr;
+  unsigned int recovered=0;
+
+  pthread_mutex_lock(&fusion_lock);
+
+  for (curr=Fusion_SectorsRoot; curr!=NULL; curr=curr->next)
+  {
+    unsigned char *block;
+    unsigned int datacrc;
+    int flipped;
+
+    if ((curr->physical_track!=physical_track) || (curr->physical_head!=physical_head) || (curr->recovered))
+      continue;
+
+    // Any more copies will be from another capture of the track
+    curr->capturestart=curr->copycount;
+
+    // Nothing to do if a good copy has since been read directly
+    if (diskstore_hassector(curr->modulation, curr->physical_track, curr->physical_head, curr->logical_track, curr->logical_head, curr->logical_sector, curr->logical_size, curr->idcrc))
+    {
+      curr->recovered=1;
+      continue;
+    }
+
+    // Too few copies give nothing to vote on
+    if (curr->copycount<FUSION_MINCOPIES)
+      continue;
+
+    block=malloc(curr->blocksize);
+    if (block==NULL)
+      continue;
+
+    flipped=fusion_fuse(curr, block);
+
+    if (flipped>=0)
+    {
+      datacrc=calc_crc(block, curr->blocksize-2);
+
+      if (fusion_debug)
+        fprintf(stderr, "** Fused sector T%d H%d - C%d H%d R%d N%d - IDCRC %.4x DATACRC %.4x from %u copies, %d bits flipped **\n", curr->physical_track, curr->physical_head, curr->logical_track, curr->logical_head, curr->logical_sector, curr->logical_size, curr->idcrc, datacrc, curr->copycount, flipped);
+
+      // Kept as fused so it can be told apart from sectors read with a good CRC, and replaced by one
+      if (diskstore_addfusedsector(curr->modulation, curr->physical_track, curr->physical_head, curr->logical_track, curr->logical_head, curr->logical_sector, curr->logical_size, curr->id_pos, curr->idcrc, curr->data_pos, curr->data_endpos, block[curr->dataoffset-1], curr->datasize, &block[curr->dataoffset], datacrc)==1)
+        recovered++;
+
+      curr->recovered=1;
+    }
+
+    free(block);
+  }
+
+  fusion_recovered+=recovered;
+
+  pthread_mutex_unlock(&fusion_lock);
+
+  return recovered;
+}
+
+// Delete all kept copies
+void fusion_clearallsectors()
+{
+  Fusion_Sector *curr;
+
+  curr=Fusion_SectorsRoot;
+
+  while (curr!=NULL)
+  {
+    Fusion_Sector *prev;
+    unsigned int i;
+
+    for (i=0; i<curr->copycount; i++)
+      free(curr->copies[i]);
+
+    prev=curr;
+    curr=curr->next;
+
+    free(prev);
+  }
+
+  Fusion_SectorsRoot=NULL;
+}
+
+void fusion_init(const int debug)
+{
+  Fusion_SectorsRoot=NULL;
+
+  fusion_debug=debug;
+  fusion_recovered=0;
+
+  atexit(fusion_clearallsectors);
+}
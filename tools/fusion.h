@@ -0,0 +1,65 @@
+#ifndef _FUSION_H_
+#define _FUSION_H_
+
+#include <stdint.h>
+
+// Maximum number of bad copies kept for each sector
+#define FUSION_MAXCOPIES 16
+
+// Minimum number of bad copies before voting, each from a different physical read, as with only two every disagreement is a tie
+#define FUSION_MINCOPIES 3
+
+// Maximum number of least certain bits to try flipping when the vote fails its CRC, tried in all combinations
+//   kept small as each combination tried is another chance of a false CRC16 match, 7 in 65536 per attempt
+#define FUSION_MAXFLIPS 3
+
+// A sector which has only been seen with a bad data CRC
+typedef struct FusionSector
+{
+  // Physical position of sector on disk
+  unsigned char modulation;
+  uint8_t physical_track;
+  uint8_t physical_head;
+
+  // Logical position of sector from a good IDAM
+  unsigned long id_pos;
+  uint8_t logical_track;
+  uint8_t logical_head;
+  uint8_t logical_sector;
+  uint8_t logical_size;
+  unsigned int idcrc;
+
+  // Data block, from the address mark up to and including the CRC, with the sector data at dataoffset
+  unsigned long data_pos;
+  unsigned long data_endpos;
+  unsigned int blocksize;
+  unsigned int dataoffset;
+  unsigned int datasize;
+
+  // Bad copies of the data block seen so far, one for each rotation of each capture, along with where each was found
+  unsigned char *copies[FUSION_MAXCOPIES];
+  unsigned long copypos[FUSION_MAXCOPIES];
+  unsigned long copyendpos[FUSION_MAXCOPIES];
+  unsigned int copycount;
+
+  // Copies from this one onwards are from the capture being decoded, earlier ones are from previous captures
+  unsigned int capturestart;
+
+  // Set once a good copy has been found, either read directly or fused
+  int recovered;
+
+  struct FusionSector *next;
+} Fusion_Sector;
+
+// Number of sectors recovered by fusing bad copies
+extern unsigned int fusion_recovered;
+
+extern void fusion_init(const int debug);
+
+// Keep a copy of a data block which failed its CRC, following a good IDAM
+extern void fusion_addcopy(const unsigned char modulation, const uint8_t physical_track, const uint8_t physical_head, const uint8_t logical_track, const uint8_t logical_head, const uint8_t logical_sector, const uint8_t logical_size, const long id_pos, const unsigned int idcrc, const long data_pos, const long data_endpos, const unsigned char *block, const unsigned int blocksize, const unsigned int dataoffset, const unsigned int datasize);
+
+// Try to recover sectors still missing from a track by fusing their bad copies
+extern unsigned int fusion_recover(const uint8_t physical_track, const uint8_t physical_head);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "hardware.h"
 #include "diskstore.h"
+#include "mod.h"
 #include "gcr.h"
 #include "pll.h"
 
@@ -71,221 +72,163 @@ DATA
 min 4x fillbytes 0x55 (NOT GCR)
 */
 
-unsigned long gcr_bucket1=63;
-unsigned long gcr_bucket01=99;
-
-unsigned char gcr_gcrbuffer[1024*1024];
-int gcr_gcrlen=0;
-
-unsigned char gcr_bytebuffer[1024*1024];
-int gcr_bytelen=0;
-
-int gcr_state=GCR_IDLE; // state machine
-unsigned int gcr_datacells; // 16 bit sliding buffer
-int gcr_bits=0; // Number of used bits within sliding buffer
-
-// Most recent address mark
-unsigned long gcr_idpos, gcr_blockpos;
-int gcr_idamtrack, gcr_idamsector; // IDAM values
-int gcr_lasttrack, gcr_lastsector; // last known good IDAM values
-unsigned int gcr_idblockcrc, gcr_datablockcrc;
-
-struct PLL *gcr_pll;
-
-int gcr_debug=0;
-
 // Add a 5 bit gcr code to the gcr buffer
-void gcr_addgcr(unsigned char gcr)
+void gcr_addgcr(GCR_Context *gcr, const unsigned char code)
 {
-  gcr_gcrbuffer[gcr_gcrlen++]=gcr;
+  gcr->gcrbuffer[gcr->gcrlen++]=code;
 }
 
-// Decode a 5-bit gcr code to 4 bit binary nibble
-unsigned char gcr_gcrtonibble(unsigned char gcr)
+// 5-bit gcr code for each 4 bit binary nibble
+const uint8_t gcr_encodemap[]=
 {
-  switch (gcr)
-  {
-    case 0x0a: return 0;
-    case 0x0b: return 1;
-    case 0x12: return 2;
-    case 0x13: return 3;
-    case 0x0e: return 4;
-    case 0x0f: return 5;
-    case 0x16: return 6;
-    case 0x17: return 7;
-    case 0x09: return 8;
-    case 0x19: return 9;
-    case 0x1a: return 10;
-    case 0x1b: return 11;
-    case 0x0d: return 12;
-    case 0x1d: return 13;
-    case 0x1e: return 14;
-    case 0x15: return 15;
-  }
+  0x0a, 0x0b, 0x12, 0x13, 0x0e, 0x0f, 0x16, 0x17,
+  0x09, 0x19, 0x1a, 0x1b, 0x0d, 0x1d, 0x1e, 0x15
+};
 
-  // Reset on error
-  gcr_state=GCR_IDLE;
-  gcr_datacells=0;
-  gcr_gcrlen=0;
-  gcr_bytelen=0;
-  gcr_bits=0;
+// Byte for each pair of 5-bit gcr codes, or GCR_INVALID if either code is invalid
+uint16_t gcr_decodemap[1<<(GCR_CODEBITS*2)];
 
-  return 0xff;
+// Build the decode map, which is shared by all contexts so only built once
+void gcr_builddecodemap()
+{
+  unsigned int i, hi, lo;
+
+  for (i=0; i<(sizeof(gcr_decodemap)/sizeof(gcr_decodemap[0])); i++)
+    gcr_decodemap[i]=GCR_INVALID;
+
+  for (hi=0; hi<sizeof(gcr_encodemap); hi++)
+    for (lo=0; lo<sizeof(gcr_encodemap); lo++)
+      gcr_decodemap[(gcr_encodemap[hi]<<GCR_CODEBITS)|gcr_encodemap[lo]]=(hi<<4)|lo;
 }
 
 // Perform an exclusive-or checksum on data
-unsigned char eorsum(int start, int end)
+unsigned char gcr_eorsum(GCR_Context *gcr, const int start, const int end)
 {
   unsigned char retval=0;
   int i;
 
   for (i=start; i<=end; i++)
-    retval=retval^gcr_bytebuffer[i];
+    retval=retval^gcr->bytebuffer[i];
 
   return retval;
 }
 
 // Decode and process a gcr encoded block
-void gcr_decodegcr()
+void gcr_decodegcr(GCR_Context *gcr, const unsigned long datapos)
 {
   int i, j;
 
-  unsigned char byteval;
-  int n=0;
-
   unsigned char eorcalc=0;
 
-  unsigned char gcrcode=0;
-  int codelen=0;
-
-  for (i=0; i<gcr_gcrlen; i++)
+  // Every 5 gcr bytes hold four pairs of 5-bit codes, each pair decoding to a byte
+  for (i=0; (i+GCR_GROUPLEN)<=gcr->gcrlen; i+=GCR_GROUPLEN)
   {
-    unsigned char enc;
+    uint64_t group=0;
 
-    enc=gcr_gcrbuffer[i];
+    for (j=0; j<GCR_GROUPLEN; j++)
+      group=(group<<8)|gcr->gcrbuffer[i+j];
 
-    for (j=0; j<8; j++)
+    for (j=((GCR_GROUPLEN*8)/(GCR_CODEBITS*2))-1; j>=0; j--)
     {
-      gcrcode=(gcrcode<<1)|((enc&0x80)>>7);
-      enc=(enc<<1);
+      uint16_t byteval=gcr_decodemap[(group>>(j*GCR_CODEBITS*2))&((1<<(GCR_CODEBITS*2))-1)];
 
-      codelen++;
-
-      if (codelen==5)
+      // Stop processing on GCR error
+      if (byteval==GCR_INVALID)
       {
-        unsigned char nibble=gcr_gcrtonibble(gcrcode);
-
-        // Stop processing on GCR error
-        if (nibble==0xff)
-        {
-//          printf("GCR error\n");
-          return;
-        }
+        gcr->state=GCR_IDLE;
+        gcr->gcrlen=0;
+        gcr->bytelen=0;
 
-        if (n==0)
-        {
-          byteval=nibble;
-          n++;
-        }
-        else
-        {
-          byteval=(byteval<<4)|nibble;
-
-          gcr_bytebuffer[gcr_bytelen++]=byteval;
-
-          n=0;
-        }
-
-        codelen=0;
-        gcrcode=0;
+        return;
       }
 
+      gcr->bytebuffer[gcr->bytelen++]=byteval;
     }
   }
 
   // Dump
 /*
-  if (gcr_debug)
+  if (gcr->debug)
   {
-    for (i=0; i<gcr_bytelen; i++)
-      fprintf(stderr, "%.2x ", gcr_bytebuffer[i]);
+    for (i=0; i<gcr->bytelen; i++)
+      fprintf(stderr, "%.2x ", gcr->bytebuffer[i]);
 
     fprintf(stderr, "\n");
   }
 */
 
-  if (gcr_bytebuffer[0]==0x08)
+  if (gcr->bytebuffer[0]==0x08)
   {
-    eorcalc=eorsum(2, 5);
+    eorcalc=gcr_eorsum(gcr, 2, 5);
 
     // Check the checksum matches before processing
-    if (gcr_bytebuffer[1]==eorcalc)
+    if (gcr->bytebuffer[1]==eorcalc)
     {
-      if (gcr_debug)
+      if (gcr->debug)
       {
-        printf("\n  Header : %.2x", gcr_bytebuffer[0]);
-        printf("  Checksum : %.2x", gcr_bytebuffer[1]);
-        printf("  Sector : %.2d", gcr_bytebuffer[2]);
-        printf("  Track : %.2d", gcr_bytebuffer[3]);
-        printf("  ID2 : %.2x", gcr_bytebuffer[4]);
-        printf("  ID1 : %.2x", gcr_bytebuffer[5]);
-        printf("  OF : %.2x", gcr_bytebuffer[6]);
-        printf("  OF : %.2x", gcr_bytebuffer[7]);
+        printf("\n  Header : %.2x", gcr->bytebuffer[0]);
+        printf("  Checksum : %.2x", gcr->bytebuffer[1]);
+        printf("  Sector : %.2d", gcr->bytebuffer[2]);
+        printf("  Track : %.2d", gcr->bytebuffer[3]);
+        printf("  ID2 : %.2x", gcr->bytebuffer[4]);
+        printf("  ID1 : %.2x", gcr->bytebuffer[5]);
+        printf("  OF : %.2x", gcr->bytebuffer[6]);
+        printf("  OF : %.2x", gcr->bytebuffer[7]);
 
         printf("  [OK]\n");
       }
 
-      gcr_idamtrack=gcr_bytebuffer[3];
-      gcr_idamsector=gcr_bytebuffer[2];
+      gcr->idamtrack=gcr->bytebuffer[3];
+      gcr->idamsector=gcr->bytebuffer[2];
 
       // Record last known good IDAM values for this track
-      gcr_lasttrack=gcr_idamtrack;
-      gcr_lastsector=gcr_idamsector;
+      gcr->lasttrack=gcr->idamtrack;
+      gcr->lastsector=gcr->idamsector;
 
-      gcr_idblockcrc=gcr_bytebuffer[1];
+      gcr->idblockcrc=gcr->bytebuffer[1];
     }
     else
     {
       // IDAM failed CRC, ignore following data block (for now)
-      gcr_idpos=0;
-      gcr_idamtrack=-1;
-      gcr_idamsector=-1;
+      gcr->idpos=0;
+      gcr->idamtrack=-1;
+      gcr->idamsector=-1;
 
-      if (gcr_debug)
-        printf("\n** INVALID ID EORSUM [%.2x] (%.2x)\n", gcr_bytebuffer[1], eorcalc);
+      if (gcr->debug)
+        printf("\n** INVALID ID EORSUM [%.2x] (%.2x)\n", gcr->bytebuffer[1], eorcalc);
     }
   }
   else
-  if (gcr_bytebuffer[0]==0x07)
+  if (gcr->bytebuffer[0]==0x07)
   {
-    eorcalc=eorsum(1, GCR_SECTORLEN);
+    eorcalc=gcr_eorsum(gcr, 1, GCR_SECTORLEN);
 
     // Check the checksum matches before processing
-    if (gcr_bytebuffer[GCR_SECTORLEN+1]==eorcalc)
+    if (gcr->bytebuffer[GCR_SECTORLEN+1]==eorcalc)
     {
-      if (gcr_debug)
+      if (gcr->debug)
       {
         printf("\nDATA EORSUM OK\n");
         printf("*** GCR good sector");
-        if ((gcr_idamtrack!=-1) && (gcr_idamsector!=-1))
-          printf(" T%d S%d", gcr_idamtrack, gcr_idamsector);
+        if ((gcr->idamtrack!=-1) && (gcr->idamsector!=-1))
+          printf(" T%d S%d", gcr->idamtrack, gcr->idamsector);
 
         printf(" ***\n");
       }
 
-      gcr_datablockcrc=gcr_bytebuffer[GCR_SECTORLEN+1];
+      gcr->datablockcrc=gcr->bytebuffer[GCR_SECTORLEN+1];
 
-      if ((gcr_idamtrack!=-1) && (gcr_idamsector!=-1))
+      if ((gcr->idamtrack!=-1) && (gcr->idamsector!=-1))
       {
-        diskstore_addsector(MODGCR, hw_currenttrack, hw_currenthead, gcr_idamtrack, hw_currenthead, gcr_idamsector, 1, gcr_idpos, gcr_idblockcrc, gcr_blockpos, gcr_bytebuffer[0], GCR_SECTORLEN, &gcr_bytebuffer[1], gcr_datablockcrc);
+        diskstore_addsector(MODGCR, gcr->track, gcr->head, gcr->idamtrack, gcr->head, gcr->idamsector, 1, gcr->idpos, gcr->idblockcrc, gcr->blockpos, datapos, gcr->bytebuffer[0], GCR_SECTORLEN, &gcr->bytebuffer[1], gcr->datablockcrc);
       }
       else
       {
-        if (gcr_debug)
+        if (gcr->debug)
         {
           printf("\n** VALID DATA BUT INVALID ID");
-          if ((gcr_lasttrack!=-1) && (gcr_lastsector!=-1))
-            printf(", last found ID was T%d S%d", gcr_lasttrack, gcr_lastsector);
+          if ((gcr->lasttrack!=-1) && (gcr->lastsector!=-1))
+            printf(", last found ID was T%d S%d", gcr->lasttrack, gcr->lastsector);
 
           printf(" **\n");
         }
@@ -293,188 +236,178 @@ void gcr_decodegcr()
     }
     else
     {
-      if (gcr_debug)
+      if (gcr->debug)
       {
-        printf("\n** INVALID DATA EORSUM [%.2x] (%.2x)", gcr_bytebuffer[GCR_SECTORLEN+1], eorcalc);
-        if ((gcr_idamtrack!=-1) && (gcr_idamsector!=-1))
-          printf(", possibly for T%d S%d", gcr_idamtrack, gcr_idamsector);
+        printf("\n** INVALID DATA EORSUM [%.2x] (%.2x)", gcr->bytebuffer[GCR_SECTORLEN+1], eorcalc);
+        if ((gcr->idamtrack!=-1) && (gcr->idamsector!=-1))
+          printf(", possibly for T%d S%d", gcr->idamtrack, gcr->idamsector);
 
         printf(" **\n");
       }
     }
 
     // Require subsequent data blocks to have a valid ID block first
-    gcr_idpos=0;
-    gcr_idamtrack=-1;
-    gcr_idamsector=-1;
+    gcr->idpos=0;
+    gcr->idamtrack=-1;
+    gcr->idamsector=-1;
   }
 
-  gcr_bytelen=0;
+  gcr->bytelen=0;
 }
 
-void gcr_addbit(const unsigned char bit, const unsigned long datapos)
+// Add cells to the sliding buffer, most significant first, either looking for a sync or collecting the block after it
+void gcr_addcells(GCR_Context *gcr, const unsigned int cells, const unsigned int count, const unsigned long datapos)
 {
-  gcr_datacells=((gcr_datacells<<1)&0xffff);
-  gcr_datacells|=bit;
-  gcr_bits++;
+  unsigned int remaining;
 
-  switch (gcr_state)
-  {
-    case GCR_IDLE:
-      if (gcr_bits>=16)
-      {
-        if (gcr_datacells==0xff52) // ID
-        {
-          if (gcr_debug)
-            fprintf(stderr, "[%lx] GCR ID\n", datapos);
+  gcr->datacells=(gcr->datacells<<count)|cells;
+  gcr->bits+=count;
 
-          gcr_gcrlen=0;
-          gcr_addgcr(gcr_datacells & 0xff);
+  if (gcr->state==GCR_IDLE)
+  {
+    // Check the sync window ending at each new cell, oldest first
+    for (remaining=count; remaining>0; remaining--)
+    {
+      unsigned int window;
 
-          gcr_idpos=datapos;
-          gcr_state=GCR_ID;
+      if ((gcr->bits-(int)(remaining-1))<16)
+        continue;
 
-          gcr_datacells=0;
-          gcr_bits=0;
+      window=(gcr->datacells>>(remaining-1))&0xffff;
 
-          // Clear IDAM cache incase previous was good and this one is bad
-          gcr_idamtrack=-1;
-          gcr_idamsector=-1;
-        }
-        else
-        if (gcr_datacells==0xff55) // DATA
-        {
-          if (gcr_debug)
-            fprintf(stderr, "[%lx] GCR DATA\n", datapos);
+      if (window==0xff52) // ID
+      {
+        if (gcr->debug)
+          fprintf(stderr, "[%lx] GCR ID\n", datapos);
 
-          gcr_gcrlen=0;
-          gcr_addgcr(gcr_datacells & 0xff);
+        gcr->gcrlen=0;
+        gcr_addgcr(gcr, window & 0xff);
 
-          gcr_blockpos=datapos;
-          gcr_state=GCR_DATA;
+        gcr->idpos=datapos;
+        gcr->state=GCR_ID;
 
-          gcr_datacells=0;
-          gcr_bits=0;
-        }
+        // Clear IDAM cache incase previous was good and this one is bad
+        gcr->idamtrack=-1;
+        gcr->idamsector=-1;
       }
-      break;
-
-    case GCR_ID:
-      if (gcr_bits>=8)
+      else
+      if (window==0xff55) // DATA
       {
-        gcr_addgcr(gcr_datacells & 0xff);
+        if (gcr->debug)
+          fprintf(stderr, "[%lx] GCR DATA\n", datapos);
 
-        gcr_bits=0;
-        gcr_datacells=0;
+        gcr->gcrlen=0;
+        gcr_addgcr(gcr, window & 0xff);
 
-        // Check for 10 encoded gcr
-        if (gcr_gcrlen==10)
-        {
-          gcr_decodegcr();
-
-          gcr_state=GCR_IDLE;
-        }
+        gcr->blockpos=datapos;
+        gcr->state=GCR_DATA;
       }
-      break;
 
-    case GCR_DATA:
-      if (gcr_bits>=8)
+      if (gcr->state!=GCR_IDLE)
       {
-        gcr_addgcr(gcr_datacells & 0xff);
+        // Any newer cells are the start of the block
+        gcr->bits=remaining-1;
+        break;
+      }
+    }
 
-        gcr_bits=0;
-        gcr_datacells=0;
+    // Only the last 16 bits are ever looked at whilst waiting for sync
+    if (gcr->bits>16)
+      gcr->bits=16;
+  }
 
-        // Check for 325 encoded gcr
-        if (gcr_gcrlen==325)
-        {
-          gcr_decodegcr();
+  // Collect whole gcr bytes, until the 10 (ID) or 325 (DATA) encoded gcr are held
+  while ((gcr->state!=GCR_IDLE) && (gcr->bits>=8))
+  {
+    gcr_addgcr(gcr, (gcr->datacells>>(gcr->bits-8)) & 0xff);
+    gcr->bits-=8;
 
-          gcr_state=GCR_IDLE;
-        }
-      }
-      break;
+    if (gcr->gcrlen==((gcr->state==GCR_ID)?GCR_IDLEN:GCR_DATALEN))
+    {
+      gcr_decodegcr(gcr, datapos);
 
-    default:
-      gcr_state=GCR_IDLE;
-      break;
+      gcr->state=GCR_IDLE;
+    }
   }
 }
 
-void gcr_addsample(const unsigned long samples, const unsigned long datapos, const int usepll)
+// Add a single bit, as recovered by the PLL
+void gcr_addbit(GCR_Context *gcr, const unsigned char bit, const unsigned long datapos)
+{
+  gcr_addcells(gcr, bit, 1, datapos);
+}
+
+void gcr_addsample(GCR_Context *gcr, const unsigned long samples, const unsigned long datapos, const int usepll)
 {
   if (usepll)
   {
-    PLL_addsample(gcr_pll, samples, datapos);
+    PLL_addsample(gcr->pll, samples, datapos);
 
     return;
   }
 
-  if (hw_currenttrack<=(17*2))
-  {
-    gcr_bucket1=63;
-    gcr_bucket01=99;
-  }
-  else
-  if (hw_currenttrack<=(24*2))
-  {
-    gcr_bucket1=66;
-    gcr_bucket01=106;
-  }
-  else
-  if (hw_currenttrack<=(30*2))
+  // All at once, "1", "01" or "001"
+  gcr_addcells(gcr, 0x1, BUCKET_CELLS(&gcr->buckets, samples), datapos);
+}
+
+void gcr_init(GCR_Context *gcr, const int debug, const char density, const uint8_t track, const uint8_t head, const float rpm)
+{
+  float limits[2];
+  (void) density;
+
+  gcr->debug=debug;
+
+  // Record where the sample data came from
+  gcr->track=track;
+  gcr->head=head;
+  gcr->rpm=rpm;
+
+  // Bit rate depends on which speed zone the track is in
+  if (gcr->track<=(17*2))
   {
-    gcr_bucket1=71;
-    gcr_bucket01=114;
+    gcr->bucket1=63;
+    gcr->bucket01=99;
   }
   else
+  if (gcr->track<=(24*2))
   {
-    gcr_bucket1=77;
-    gcr_bucket01=122;
-  }
-
-  if (samples<=gcr_bucket1)
-  {
-    gcr_addbit(1, datapos);
+    gcr->bucket1=66;
+    gcr->bucket01=106;
   }
   else
-  if (samples<=gcr_bucket01)
+  if (gcr->track<=(30*2))
   {
-    gcr_addbit(0, datapos);
-    gcr_addbit(1, datapos);
+    gcr->bucket1=71;
+    gcr->bucket01=114;
   }
   else
   {
-    gcr_addbit(0, datapos);
-    gcr_addbit(0, datapos);
-    gcr_addbit(1, datapos);
+    gcr->bucket1=77;
+    gcr->bucket01=122;
   }
-}
-
-void gcr_init(const int debug, const char density)
-{
-  (void) density;
 
-  gcr_debug=debug;
+  limits[0]=gcr->bucket1;
+  limits[1]=gcr->bucket01;
+  bucket_build(&gcr->buckets, limits, 2, 1);
 
-  if (gcr_pll!=NULL)
-    PLL_reset(gcr_pll, 63);
+  if (gcr->pll!=NULL)
+    PLL_reset(gcr->pll, 63);
   else
-    gcr_pll=PLL_create(63, gcr_addbit);
+    gcr->pll=PLL_create(63, gcr_addbit, gcr);
 
   // Set up C64 GCR parser
-  gcr_state=GCR_IDLE;
-  gcr_bits=0;
-  gcr_datacells=0;
+  gcr->state=GCR_IDLE;
+  gcr->bits=0;
+  gcr->datacells=0;
 
-  gcr_idpos=0;
-  gcr_blockpos=0;
+  gcr->idpos=0;
+  gcr->blockpos=0;
 
   // Initialise last found sector IDAM to invalid
-  gcr_idamtrack=-1;
-  gcr_idamsector=-1;
+  gcr->idamtrack=-1;
+  gcr->idamsector=-1;
 
   // Initialise last known good sector IDAM to invalid
-  gcr_lasttrack=-1;
-  gcr_lastsector=-1;
+  gcr->lasttrack=-1;
+  gcr->lastsector=-1;
 }
@@ -1,6 +1,10 @@
 #ifndef _GCR_H_
 #define _GCR_H_
 
+#include <stdint.h>
+
+#include "bucket.h"
+
 // State machine
 #define GCR_IDLE 0
 #define GCR_ID 1
@@ -8,11 +12,52 @@
 
 #define GCR_SECTORLEN 256
 
-extern int gcr_idamtrack, gcr_idamsector;
-extern int gcr_lasttrack, gcr_lastsector;
+// Encoded block lengths, 5 gcr bits for each 4 bits of data
+#define GCR_IDLEN 10
+#define GCR_DATALEN 325
+
+// Decoding is done a byte at a time, from pairs of 5-bit codes taken from each group of 5 gcr bytes
+#define GCR_CODEBITS 5
+#define GCR_GROUPLEN 5
+#define GCR_INVALID 0x100
+
+typedef struct GCRContext
+{
+  // Physical position and speed the sample data was captured with
+  uint8_t track;
+  uint8_t head;
+  float rpm;
+
+  // Sample thresholds for the speed zone of this track
+  unsigned long bucket1;
+  unsigned long bucket01;
+  Bucket_Table buckets;
+
+  unsigned char gcrbuffer[GCR_DATALEN];
+  int gcrlen;
+
+  unsigned char bytebuffer[(GCR_DATALEN*4)/5];
+  int bytelen;
+
+  int state; // state machine
+  unsigned int datacells; // Sliding buffer, of which the most recent 16 bits are used
+  int bits; // Number of used bits within sliding buffer
+
+  // Most recent address mark
+  unsigned long idpos, blockpos;
+  int idamtrack, idamsector; // IDAM values
+  int lasttrack, lastsector; // last known good IDAM values
+  unsigned int idblockcrc, datablockcrc;
+
+  struct PLL *pll;
+
+  int debug;
+} GCR_Context;
+
+extern void gcr_builddecodemap();
 
-extern void gcr_addsample(const unsigned long samples, const unsigned long datapos, const int usepll);
+extern void gcr_addsample(GCR_Context *gcr, const unsigned long samples, const unsigned long datapos, const int usepll);
 
-extern void gcr_init(const int debug, const char density);
+extern void gcr_init(GCR_Context *gcr, const int debug, const char density, const uint8_t track, const uint8_t head, const float rpm);
 
 #endif
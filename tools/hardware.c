@@ -19,6 +19,23 @@ float hw_rpm = HW_DEFAULTRPM;
 
 int hw_stepping = HW_NORMALSTEPPING;
 
+// Time in milliseconds between step pulses, and number of steps made
+unsigned int hw_steprate = HW_MAXSTEPRATE;
+unsigned long hw_stepcount = 0;
+
+// Amount of the current sample buffer which is ready for processing
+unsigned long hw_sampledbytes = 0;
+
+// When set, sampling finishes early once this becomes non-zero
+int *hw_samplestop = NULL;
+
+// Sample buffer positions of index pulses seen during the last capture
+unsigned long hw_indexpos[HW_MAXINDEXES];
+unsigned int hw_indexcount = 0;
+
+// Ring of blocks which raw SPI data is received into
+unsigned char hw_spiring[HW_SPIRINGSIZE];
+
 void hw_setscaling(const char *scale)
 {
   const char governor_policy[]="/sys/devices/system/cpu/cpufreq/policy0/scaling_governor";
@@ -222,7 +239,9 @@ void hw_seekin()
   bcm2835_gpio_set(DIR_STEP);
   delayMicroseconds(8);
   bcm2835_gpio_clr(DIR_STEP);
-  delay(40); // wait maximum time for step
+  delay(hw_steprate); // wait until drive can take next step, settling is done once at destination
+
+  hw_stepcount++;
 }
 
 // Seek head out by 1 track, towards track zero
@@ -232,7 +251,9 @@ void hw_seekout()
   bcm2835_gpio_set(DIR_STEP);
   delayMicroseconds(8);
   bcm2835_gpio_clr(DIR_STEP);
-  delay(40); // wait maximum time for step
+  delay(hw_steprate); // wait until drive can take next step, settling is done once at destination
+
+  hw_stepcount++;
 }
 
 // Seek head to track zero
@@ -312,6 +333,15 @@ void hw_setmaxtracks(const int maxtracks)
   hw_maxtracks=maxtracks;
 }
 
+// Set time between step pulses, as fast as the drive allows
+void hw_setsteprate(const unsigned int ms)
+{
+  if ((ms>0) && (ms<=HW_MAXSTEPRATE))
+    hw_steprate=ms;
+  else
+    hw_steprate=HW_MAXSTEPRATE;
+}
+
 // Try to see if both a disk and drive are detectable
 unsigned char hw_detectdisk()
 {
@@ -419,72 +449,97 @@ void hw_sideselect(const int side)
   }
 }
 
-// Fix SPI sample buffer timings
-void hw_fixspisamples(unsigned char *inbuf, long inlen, unsigned char *outbuf, long outlen)
+// Sample raw track data
+//   SPI data is received into a ring of blocks whilst keeping the FIFOs serviced, so
+//   there are no gaps in sampling. Received data is fixed a slice at a time in between
+//   servicing the FIFOs, and each completed block is made available via hw_sampledbytes.
+//   Sampling can be stopped early via hw_samplestop, once enough data has been processed.
+void hw_samplerawtrackdata(unsigned char* buf, uint32_t len)
 {
-  long inpos, outpos;
-  unsigned char o, olen, bitpos;
+  volatile uint32_t *paddr=bcm2835_spi0+(BCM2835_SPI0_CS/4);
+  volatile uint32_t *fifo=bcm2835_spi0+(BCM2835_SPI0_FIFO/4);
+  uint32_t rawlen, txcnt, rxcnt, fixcnt, fixlen;
+  uint8_t index, lastindex;
 
-  outpos=0; o=0; olen=0;
+  __atomic_store_n(&hw_sampledbytes, 0, __ATOMIC_RELEASE);
 
-  for (inpos=0; inpos<inlen; inpos++)
-  {
-    unsigned char c;
+  // Each raw byte gives 9 samples once fixed, so fewer are needed to fill the buffer
+  rawlen=((((unsigned long long)len)*BITSPERBYTE)+(BITSPERBYTE+1)-1)/(BITSPERBYTE+1);
 
-    c=inbuf[inpos];
+  hw_fixspireset();
+  txcnt=0; rxcnt=0; fixcnt=0;
 
-    // Insert extra sample, this is due to SPI sampling leaving a 1 sample gap between each group of 8 samples
-    o=(o<<1)|((c&0x80)>>7);
-    olen++;
-    if (olen==BITSPERBYTE)
-    {
-      if (outpos<outlen)
-        outbuf[outpos++]=o;
+  // Sample using SPI, starting at an index pulse
+  hw_waitforindex();
+  hw_indexpos[0]=0;
+  hw_indexcount=1;
+  lastindex=HIGH;
 
-      olen=0; o=0;
+  // Clear TX and RX FIFOs, then start the transfer
+  bcm2835_peri_set_bits(paddr, BCM2835_SPI0_CS_CLEAR, BCM2835_SPI0_CS_CLEAR);
+  bcm2835_peri_set_bits(paddr, BCM2835_SPI0_CS_TA, BCM2835_SPI0_CS_TA);
+
+  while (rxcnt<rawlen)
+  {
+    // Stop sending once requested, letting anything in flight be received
+    if ((hw_samplestop!=NULL) && (__atomic_load_n(hw_samplestop, __ATOMIC_ACQUIRE)!=0))
+      rawlen=txcnt;
+
+    // Keep TX FIFO topped up, without getting further ahead than the ring can hold
+    while ((txcnt<rawlen) && ((txcnt-fixcnt)<HW_SPIRINGSIZE) && ((bcm2835_peri_read(paddr)&BCM2835_SPI0_CS_TXD)!=0))
+    {
+      bcm2835_peri_write_nb(fifo, 0);
+      txcnt++;
     }
 
-    // Process the 8 valid samples we did get
-    for (bitpos=0; bitpos<BITSPERBYTE; bitpos++)
+    // Move anything received into the ring
+    while ((rxcnt<txcnt) && ((bcm2835_peri_read(paddr)&BCM2835_SPI0_CS_RXD)!=0))
     {
-      o=(o<<1)|((c&0x80)>>7);
-      olen++;
+      hw_spiring[rxcnt%HW_SPIRINGSIZE]=bcm2835_peri_read_nb(fifo);
+      rxcnt++;
+    }
 
-      if (olen==BITSPERBYTE)
-      {
-        if (outpos<outlen)
-          outbuf[outpos++]=o;
+    // Record where in the samples each index pulse starts
+    index=bcm2835_gpio_lev(INDEX_PULSE);
+    if ((index==HIGH) && (lastindex==LOW) && (hw_indexcount<HW_MAXINDEXES))
+      hw_indexpos[hw_indexcount++]=(((unsigned long)rxcnt)*(BITSPERBYTE+1))/BITSPERBYTE;
+    lastindex=index;
 
-        olen=0; o=0;
-      }
+    // Fix a slice of received data, stopping at the end of each ring block
+    fixlen=rxcnt-fixcnt;
+    if (fixlen>HW_SPIFIXSLICE) fixlen=HW_SPIFIXSLICE;
+    if (fixlen>(HW_SPIBLOCKSIZE-(fixcnt%HW_SPIBLOCKSIZE))) fixlen=HW_SPIBLOCKSIZE-(fixcnt%HW_SPIBLOCKSIZE);
 
-      c=c<<1;
-    }
+    if (fixlen>0)
+    {
+      hw_fixspiblock(&hw_spiring[fixcnt%HW_SPIRINGSIZE], fixlen, buf, len);
+      fixcnt+=fixlen;
 
-    // Stop on output buffer overflow
-    if (outpos>=outlen) return;
+      // Hand over each completed block
+      if ((fixcnt%HW_SPIBLOCKSIZE)==0)
+        __atomic_store_n(&hw_sampledbytes, hw_fixoutpos, __ATOMIC_RELEASE);
+    }
   }
-}
-
-// Sample raw track data
-void hw_samplerawtrackdata(unsigned char* buf, uint32_t len)
-{
-  char *rawbuf;
 
-  // Clear output buffer to prevent failed reads potentially returning previous data
-  bzero(buf, len);
+  // Wait for transfer to complete, then stop it
+  while ((bcm2835_peri_read_nb(paddr)&BCM2835_SPI0_CS_DONE)==0) { }
+  bcm2835_peri_set_bits(paddr, 0, BCM2835_SPI0_CS_TA);
 
-  rawbuf=malloc(len);
-  if (rawbuf==NULL) return;
+  // Fix whatever remains in the ring
+  while (fixcnt<rxcnt)
+  {
+    fixlen=rxcnt-fixcnt;
+    if (fixlen>(HW_SPIBLOCKSIZE-(fixcnt%HW_SPIBLOCKSIZE))) fixlen=HW_SPIBLOCKSIZE-(fixcnt%HW_SPIBLOCKSIZE);
 
-  // Sample using SPI
-  hw_waitforindex();
-  bcm2835_spi_transfern(rawbuf, len);
+    hw_fixspiblock(&hw_spiring[fixcnt%HW_SPIRINGSIZE], fixlen, buf, len);
+    fixcnt+=fixlen;
+  }
 
-  // Fix SPI timings
-  hw_fixspisamples(rawbuf, len, buf, len);
+  // Clear anything not sampled, to prevent it returning previous data
+  if ((unsigned long)hw_fixoutpos<len)
+    bzero(&buf[hw_fixoutpos], len-hw_fixoutpos);
 
-  free(rawbuf);
+  __atomic_store_n(&hw_sampledbytes, hw_fixoutpos, __ATOMIC_RELEASE);
 }
 
 void hw_sleep(const unsigned int seconds)
@@ -492,6 +547,27 @@ void hw_sleep(const unsigned int seconds)
   sleep(seconds);
 }
 
+// Wait for a number of milliseconds
+void hw_delay(const unsigned int ms)
+{
+  delay(ms);
+}
+
+// Determine RPM from the average spacing of index pulses within sample data
+float hw_indexrpm(const unsigned long *indexes, const unsigned int indexcount)
+{
+  unsigned long rotation;
+
+  if ((indexes==NULL) || (indexcount<2))
+    return 0;
+
+  rotation=(indexes[indexcount-1]-indexes[0])/(indexcount-1);
+  if (rotation==0)
+    return 0;
+
+  return ((float)hw_samplerate*SECONDSINMINUTE)/((float)rotation*BITSPERBYTE);
+}
+
 // Measure time between index pulses to determine RPM
 float hw_measurerpm()
 {
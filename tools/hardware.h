@@ -15,6 +15,9 @@
 #define HW_NORMALSTEPPING 1
 #define HW_DOUBLESTEPPING 2
 
+// Slowest time in milliseconds between step pulses, used until a faster rate is set
+#define HW_MAXSTEPRATE 40
+
 // For RPM calculation
 #define SECONDSINMINUTE 60
 
@@ -32,6 +35,22 @@
 #define HW_DEFAULTRPM 300
 #define HW_ROTATIONSPERSEC (HW_DEFAULTRPM/SECONDSINMINUTE)
 
+// For chunked SPI capture, raw data is received into a ring of blocks
+#define HW_SPIBLOCKSIZE 4096
+#define HW_SPIBLOCKS 4
+#define HW_SPIRINGSIZE (HW_SPIBLOCKSIZE*HW_SPIBLOCKS)
+
+// Maximum number of index pulse positions recorded per capture
+#define HW_MAXINDEXES 8
+
+// Maximum raw bytes to fix between servicing the SPI FIFOs
+#define HW_SPIFIXSLICE 16
+
+// Fixing SPI samples, each raw byte becomes 9 samples with the first repeated
+#define HW_FIXSAMPLES (BITSPERBYTE+1)
+#define HW_FIXBYTE(c) (((((uint64_t)(c))&0x80)<<1)|((uint64_t)(c)))
+#define HW_FIXGROUP 4
+
 // For SPI clock dividers
 #define HW_SPIDIV1024 1024
 #define HW_SPIDIV512 512
@@ -54,6 +73,16 @@ extern unsigned long hw_samplerate;
 extern float hw_rpm;
 
 extern int hw_stepping;
+extern unsigned int hw_steprate;
+extern unsigned long hw_stepcount;
+extern unsigned long hw_sampledbytes;
+extern int *hw_samplestop;
+extern unsigned long hw_indexpos[HW_MAXINDEXES];
+extern unsigned int hw_indexcount;
+
+#ifdef NOPI
+extern int hw_emulatetiming;
+#endif
 
 // Initialisation
 #ifdef NOPI
@@ -74,6 +103,7 @@ extern void hw_seektotrackzero();
 extern void hw_seektotrack(const int track);
 extern void hw_sideselect(const int side);
 extern void hw_setmaxtracks(const int maxtracks);
+extern void hw_setsteprate(const unsigned int ms);
 extern void hw_seekin();
 extern void hw_seekout();
 
@@ -82,7 +112,14 @@ extern void hw_waitforindex();
 extern int hw_writeprotected();
 extern void hw_samplerawtrackdata(unsigned char *buf, uint32_t len);
 extern void hw_sleep(const unsigned int seconds);
+extern void hw_delay(const unsigned int ms);
 extern float hw_measurerpm();
+extern float hw_indexrpm(const unsigned long *indexes, const unsigned int indexcount);
+
+// Fixing SPI sample timings
+extern long hw_fixoutpos;
+extern void hw_fixspireset();
+extern void hw_fixspiblock(const unsigned char *inbuf, long inlen, unsigned char *outbuf, long outlen);
 extern void hw_fixspisamples(unsigned char *inbuf, long inlen, unsigned char *outbuf, long outlen);
 
 // Clean up
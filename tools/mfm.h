@@ -1,6 +1,11 @@
 #ifndef _MFM_H_
 #define _MFM_H_
 
+#include <stdint.h>
+
+#include "bucket.h"
+#include "crc.h"
+
 // Microseconds in a bitcell window for double density MFM at 300 RPM
 #define MFM_BITCELLDD 4
 // Microseconds in a bitcell window for high density MFM at 300 RPM
@@ -13,6 +18,11 @@
 #define MFM_ACCESS_INDEX 0xc2
 #define MFM_ACCESS_SECTOR 0xa1
 
+// Sync marks as the last 64 cells, data bits of the access marks then the missing clock mark
+#define MFM_SYNCMASK 0x555555555555ffffULL
+#define MFM_IDSYNC 0x0000440144014489ULL
+#define MFM_IAMSYNC 0x0000500450045224ULL
+
 // MFM Block types
 #define MFM_BLOCKNULL 0x00
 #define MFM_BLOCKINDEX 0xfc
@@ -46,11 +56,45 @@
 #define MFM_ADDR 3
 #define MFM_DATA 4
 
-extern int mfm_idamtrack, mfm_idamhead, mfm_idamsector, mfm_idamlength;
-extern int mfm_lasttrack, mfm_lasthead, mfm_lastsector, mfm_lastlength;
+typedef struct MFMContext
+{
+  // Physical position and speed the sample data was captured with
+  uint8_t track;
+  uint8_t head;
+  float rpm;
+
+  int state; // state machine
+  uint64_t cells; // 64 bit sliding buffer, the most recent 16 bits are being processed, the rest are history
+  int bits; // Number of new bits within sliding buffer
+
+  // Most recent address mark
+  unsigned long idpos, blockpos;
+  int idamtrack, idamhead, idamsector, idamlength; // IDAM values
+  int lasttrack, lasthead, lastsector, lastlength; // last known good IDAM values
+  unsigned char blocktype;
+  unsigned int blocksize;
+  unsigned int idblockcrc, datablockcrc, bitstreamcrc;
+
+  // Output block data buffer, for a single sector
+  unsigned char bitstream[MFM_BLOCKSIZE];
+  unsigned int bitlen;
+
+  // CRC of all but the last two bytes of the block so far, kept up to date as bytes arrive
+  const CRC_Table *crctable;
+  uint16_t blockcrc;
+
+  // MFM timings
+  float defaultwindow;
+  float bucket01, bucket001, bucket0001;
+  Bucket_Table buckets;
+
+  struct PLL *pll;
+
+  int debug;
+} MFM_Context;
 
-extern void mfm_addsample(const unsigned long samples, const unsigned long datapos, const int usepll);
+extern void mfm_addsample(MFM_Context *mfm, const unsigned long samples, const unsigned long datapos, const int usepll);
 
-extern void mfm_init(const int debug, const char density);
+extern void mfm_init(MFM_Context *mfm, const int debug, const char density, const uint8_t track, const uint8_t head, const float rpm);
 
 #endif
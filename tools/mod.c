@@ -1,6 +1,10 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "hardware.h"
+#include "diskstore.h"
+#include "fusion.h"
+#include "flux.h"
 #include "fm.h"
 #include "mfm.h"
 #include "amigamfm.h"
@@ -9,14 +13,79 @@
 #include "mod.h"
 
 int mod_debug=0;
-unsigned long mod_datapos;
 unsigned long mod_samplesize;
 
-unsigned long mod_hist[MOD_HISTOGRAMSIZE];
-int mod_peak[MOD_PEAKSIZE];
-int mod_peaks;
+Mod_Context mod_context;
+
+// Check if each decoder found sector IDs
+int mod_foundfm(const Mod_Decoders *decoders)
+{
+  return (decoders->fm.lasttrack!=-1);
+}
+
+int mod_foundamigamfm(const Mod_Decoders *decoders)
+{
+  return (decoders->amigamfm.lasttrack!=-1);
+}
+
+int mod_foundmfm(const Mod_Decoders *decoders)
+{
+  return (decoders->mfm.lasttrack!=-1);
+}
+
+int mod_foundgcr(const Mod_Decoders *decoders)
+{
+  return (decoders->gcr.lasttrack!=-1);
+}
+
+int mod_foundapplegcr(const Mod_Decoders *decoders)
+{
+  return (decoders->applegcr.lasttrack!=-1);
+}
+
+// Known decoders, all are fed each flux transition until narrowed down
+static const Mod_Decoder mod_decoders[] = {
+  {"fm", "FM, single density", offsetof(Mod_Decoders, fm), (Mod_Init)fm_init, (Mod_AddSample)fm_addsample, mod_foundfm},
+  {"amiga", "Amiga MFM", offsetof(Mod_Decoders, amigamfm), (Mod_Init)amigamfm_init, (Mod_AddSample)amigamfm_addsample, mod_foundamigamfm},
+  {"mfm", "MFM, double/high/extra density", offsetof(Mod_Decoders, mfm), (Mod_Init)mfm_init, (Mod_AddSample)mfm_addsample, mod_foundmfm},
+  {"gcr", "Commodore 64 GCR", offsetof(Mod_Decoders, gcr), (Mod_Init)gcr_init, (Mod_AddSample)gcr_addsample, mod_foundgcr},
+  {"applegcr", "Apple II GCR", offsetof(Mod_Decoders, applegcr), (Mod_Init)applegcr_init, (Mod_AddSample)applegcr_addsample, mod_foundapplegcr},
+  {NULL, NULL, 0, NULL, NULL, NULL}
+};
+
+// Decoders in use, and whether they were chosen on the command line
+unsigned int mod_decodermask=MOD_DECODERSALL;
+int mod_decoderforced=0;
+
+// Decoders which have found sector IDs so far, by any context
+unsigned int mod_foundmask=0;
+
+// Even numbered bits of each byte, packed into a nibble, for separating data and clock cells
+const unsigned char mod_evenbits[256] = {
+  0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3, 0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
+  0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7, 0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
+  0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3, 0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
+  0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7, 0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
+  0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb, 0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
+  0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf, 0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf,
+  0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb, 0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
+  0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf, 0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf,
+  0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3, 0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
+  0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7, 0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
+  0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3, 0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
+  0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7, 0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
+  0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb, 0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
+  0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf, 0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf,
+  0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb, 0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
+  0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf, 0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf
+};
+
 char mod_density=MOD_DENSITYAUTO;
 
+// Intervals and densities for each physical track/head, so later captures of a track needn't classify it again
+//   each track/head is only ever demodulated by one thread at a time
+Mod_Track mod_tracks[HW_MAXTRACKS][HW_MAXHEADS];
+
 float mod_samplestous(const long samples)
 {
   return ((float)1/(((float)hw_samplerate)/(float)USINSECOND))*(float)samples;
@@ -27,94 +96,106 @@ long mod_mstosamples(const float ms)
   return (ms/((float)1/(((float)hw_samplerate)/(float)USINSECOND)));
 }
 
-void mod_buildhistogram(const unsigned char *sampledata, const unsigned long samplesize)
+// Find the cached intervals for a physical track/head, if it's within range
+Mod_Track *mod_gettrack(const uint8_t track, const uint8_t head)
 {
-  int j;
-  char level,bi=0;
-  int count;
-  unsigned long datapos;
+  if ((track>=HW_MAXTRACKS) || (head>=HW_MAXHEADS))
+    return NULL;
+
+  return &mod_tracks[track][head];
+}
+
+// Count the samples between rising edges not yet counted, up to samplesize, then build the histogram from all counted so far
+//   counts are added to the track/head's, or just this sample data's when out of range
+void mod_buildhistogram(Mod_Context *context, Mod_Track *cached, const unsigned char *sampledata, const unsigned long samplesize)
+{
+  Flux_List *flux=context->flux;
+  unsigned long *counts;
+  unsigned long edge, nextsample, limit;
+  unsigned long count;
 
   if (mod_debug)
-    fprintf(stderr, "Creating histogram for track %d, head %d data sampled at %lu with %.2f rpm\n", hw_currenttrack, hw_currenthead, hw_samplerate, hw_rpm);
+    fprintf(stderr, "Creating histogram for track %d, head %d data sampled at %lu with %.2f rpm\n", context->track, context->head, hw_samplerate, context->rpm);
 
-  // Clear histogram
-  for (j=0; j<MOD_HISTOGRAMSIZE; j++) mod_hist[j]=0;
+  counts=(cached!=NULL)?cached->counts:context->counts;
 
-  // Build histogram
-  level=(sampledata[0]&0x80)>>7;
-  bi=level;
-  count=0;
+  // Make sure the level changes have been found
+  if (flux->sampledata!=sampledata)
+    flux_start(flux, sampledata);
+  flux_extend(flux, samplesize);
 
-  for (datapos=0; datapos<samplesize; datapos++)
+  // Start counting from the beginning of new sample data
+  if (context->histgeneration!=flux->generation)
   {
-    unsigned char c;
+    context->histgeneration=flux->generation;
+    context->histedge=flux->firstrising;
+    context->histnext=0;
 
-    c=sampledata[datapos];
+    if (cached==NULL)
+      memset(context->counts, 0, sizeof(context->counts));
+  }
 
-    for (j=0; j<BITSPERBYTE; j++)
-    {
-      bi=((c&0x80)>>7);
+  // Carry on from wherever counting reached last time
+  limit=samplesize*BITSPERBYTE;
+  nextsample=context->histnext;
 
-      count++;
+  for (edge=context->histedge; edge<flux->count; edge+=2)
+  {
+    if (flux->edges[edge]>=limit)
+      break;
 
-      if (bi!=level)
-      {
-        level=1-level;
+    count=(flux->edges[edge]+1)-nextsample;
+    nextsample=flux->edges[edge]+1;
 
-        // Look for rising edge
-        if (level==1)
-        {
-          if (count<MOD_HISTOGRAMSIZE)
-            mod_hist[count]++;
+    if (count<MOD_HISTOGRAMSIZE)
+      counts[count]++;
+  }
 
-          count=0;
-        }
-      }
+  context->histedge=edge;
+  context->histnext=nextsample;
 
-      c=c<<1;
-    }
-  }
+  memcpy(context->hist, counts, sizeof(context->hist));
 }
 
-int mod_findpeaks(const unsigned char *sampledata, const unsigned long samplesize)
+int mod_findpeaks(Mod_Context *context, Mod_Track *cached, const unsigned char *sampledata, const unsigned long samplesize)
 {
   int j;
   long localmaxima;
   unsigned long threshold;
   int inpeak;
 
-  mod_buildhistogram(sampledata, samplesize);
+  mod_buildhistogram(context, cached, sampledata, samplesize);
 
   // Find largest histogram value
   localmaxima=0;
   for (j=0; j<MOD_HISTOGRAMSIZE; j++)
-    if (mod_hist[j]>mod_hist[localmaxima])
+    if (context->hist[j]>context->hist[localmaxima])
       localmaxima=j;
 
   if (mod_debug)
-    fprintf(stderr, "Maximum peak on track %d, head %d at %ld samples, %.3fms\n", hw_currenttrack, hw_currenthead, localmaxima, mod_samplestous(localmaxima));
+    fprintf(stderr, "Maximum peak on track %d, head %d at %ld samples, %.3fms\n", context->track, context->head, localmaxima, mod_samplestous(localmaxima));
 
   // Set noise threshold at 5% of maximum
-  threshold=mod_hist[localmaxima]/20;
+  threshold=context->hist[localmaxima]/20;
 
   // Decimate histogram to remove values below threshold
   for (j=0; j<MOD_HISTOGRAMSIZE; j++)
-    if (mod_hist[j]<=threshold)
-      mod_hist[j]=0;
+    if (context->hist[j]<=threshold)
+      context->hist[j]=0;
 
   // Find peaks
-  inpeak=0; mod_peaks=0; localmaxima=0;
+  inpeak=0; context->peaks=0; localmaxima=0;
   for (j=0; j<MOD_HISTOGRAMSIZE; j++)
   {
-    if (mod_hist[j]!=0)
+    if (context->hist[j]!=0)
     {
-      if (mod_hist[j]>mod_hist[localmaxima])
+      if (context->hist[j]>context->hist[localmaxima])
         localmaxima=j;
 
       // Mark the start of a new peak
       if (inpeak==0)
       {
-        mod_peaks++;
+        context->peaks++;
         inpeak=1;
       }
     }
@@ -125,8 +206,8 @@ int mod_findpeaks(const unsigned char *sampledata, const unsigned long samplesiz
         if (mod_debug)
           fprintf(stderr, "  Peak at %ld %.3fms\n", localmaxima, mod_samplestous(localmaxima));
 
-        if (mod_peaks<MOD_PEAKSIZE)
-          mod_peak[mod_peaks-1]=localmaxima;
+        if (context->peaks<MOD_PEAKSIZE)
+          context->peak[context->peaks-1]=localmaxima;
 
         localmaxima=0;
       }
@@ -136,20 +217,20 @@ int mod_findpeaks(const unsigned char *sampledata, const unsigned long samplesiz
   }
 
   if (mod_debug)
-    fprintf(stderr, "Found %d peaks\n", mod_peaks);
+    fprintf(stderr, "Found %d peaks\n", context->peaks);
 
-  return mod_peaks;
+  return context->peaks;
 }
 
-int mod_haspeak(const float ms)
+int mod_haspeak(const Mod_Context *context, const float ms)
 {
   int i;
 
-  for (i=0; i<mod_peaks; i++)
+  for (i=0; i<context->peaks; i++)
   {
     float peakms;
 
-    peakms=mod_samplestous(mod_peak[i]);
+    peakms=mod_samplestous(context->peak[i]);
 
     // Look within 10% of nominal
     if ((ms>=(peakms*0.90)) && (ms<=(peakms*1.1)))
@@ -159,153 +240,355 @@ int mod_haspeak(const float ms)
   return 0;
 }
 
-void mod_checkdensity()
+// Classify the density of the sample data from the peaks found in its histogram
+char mod_checkdensity(const Mod_Context *context)
 {
   // APPLE GCR
   // 1=4ms, 01=8ms, 001=12ms
-  if ((mod_haspeak(4)+mod_haspeak(8)+mod_haspeak(12))==3)
+  if ((mod_haspeak(context, 4)+mod_haspeak(context, 8)+mod_haspeak(context, 12))==3)
   {
-    mod_density|=MOD_DENSITYAPPLEGCR;
-
-    return;
+    return MOD_DENSITYAPPLEGCR;
   }
 
   // MFM ED
   // 01=1ms, 001=1.5ms, 0001=2ms
-  if ((mod_haspeak(1)+mod_haspeak(1.5)+mod_haspeak(2))==3)
+  if ((mod_haspeak(context, 1)+mod_haspeak(context, 1.5)+mod_haspeak(context, 2))==3)
   {
-    mod_density|=MOD_DENSITYMFMED;
-
-    return;
+    return MOD_DENSITYMFMED;
   }
 
   // MFM HD
   // 01=2ms, 001=3ms, 0001=4ms
-  if ((mod_haspeak(2)+mod_haspeak(3)+mod_haspeak(4))==3)
+  if ((mod_haspeak(context, 2)+mod_haspeak(context, 3)+mod_haspeak(context, 4))==3)
   {
-    mod_density|=MOD_DENSITYMFMHD;
-
-    return;
+    return MOD_DENSITYMFMHD;
   }
 
   // MFM DD
   // 01=4ms, 001=6ms, 0001=8ms
-  if ((mod_haspeak(4)+mod_haspeak(6)+mod_haspeak(8))==3)
+  if ((mod_haspeak(context, 4)+mod_haspeak(context, 6)+mod_haspeak(context, 8))==3)
   {
-    mod_density|=MOD_DENSITYMFMDD;
-
-    return;
+    return MOD_DENSITYMFMDD;
   }
 
   // FM SD
   // 1=4ms, 01=8ms
-  if ((mod_haspeak(4)+mod_haspeak(8))==2)
+  if ((mod_haspeak(context, 4)+mod_haspeak(context, 8))==2)
   {
-    mod_density|=MOD_DENSITYFMSD;
-
-    return;
+    return MOD_DENSITYFMSD;
   }
+
+  return MOD_DENSITYAUTO;
 }
 
 unsigned char mod_getclock(const unsigned int datacells)
 {
-  unsigned char clock;
-
-  clock=((datacells&0x8000)>>8);
-  clock|=((datacells&0x2000)>>7);
-  clock|=((datacells&0x0800)>>6);
-  clock|=((datacells&0x0200)>>5);
-  clock|=((datacells&0x0080)>>4);
-  clock|=((datacells&0x0020)>>3);
-  clock|=((datacells&0x0008)>>2);
-  clock|=((datacells&0x0002)>>1);
-
-  return clock;
+  return MOD_GETCLOCK(datacells);
 }
 
 unsigned char mod_getdata(const unsigned int datacells)
 {
-  unsigned char data;
-
-  data=((datacells&0x4000)>>7);
-  data|=((datacells&0x1000)>>6);
-  data|=((datacells&0x0400)>>5);
-  data|=((datacells&0x0100)>>4);
-  data|=((datacells&0x0040)>>3);
-  data|=((datacells&0x0010)>>2);
-  data|=((datacells&0x0004)>>1);
-  data|=((datacells&0x0001)>>0);
-
-  return data;
+  return MOD_GETDATA(datacells);
 }
 
-void mod_process(const unsigned char *sampledata, const unsigned long samplesize, const int attempt, const int usepll)
+// Set up demodulation state, using the given list for the level changes
+void mod_initcontext(Mod_Context *context, Flux_List *flux)
 {
-  unsigned char c, j;
-  int run;
-  (void) attempt;
+  memset(context, 0, sizeof(Mod_Context));
+
+  context->flux=flux;
+  context->rpm=HW_DEFAULTRPM;
+}
+
+// Start demodulating a sample buffer, finding peaks from the first histogramsize bytes
+void mod_start(Mod_Context *context, const unsigned char *sampledata, const unsigned long samplesize, const unsigned long histogramsize, const uint8_t track, const uint8_t head, const float rpm, const int passes)
+{
+  unsigned int i, pass;
+  Mod_Track *cached;
+  char trackdensity;
+
+  // Record where the sample data came from, as the drive may have moved on since
+  context->track=track;
+  context->head=head;
+  context->rpm=rpm;
+
+  context->samplesize=samplesize;
+  context->passes=passes;
 
-  for (run=0; run<(usepll==0?1:2); run++)
+  // Level changes are found as the sample data is fed in
+  if (context->flux->sampledata!=sampledata)
+    flux_start(context->flux, sampledata);
+
+  // Densities seen on earlier tracks still apply, along with any found on this one
+  context->density=__atomic_load_n(&mod_density, __ATOMIC_ACQUIRE);
+
+  // Only classify a track until its density is known, adding to the intervals from any earlier captures of it
+  cached=mod_gettrack(track, head);
+
+  if ((cached!=NULL) && (cached->density!=MOD_DENSITYAUTO))
+  {
+    if (mod_debug)
+      fprintf(stderr, "Using density already found for track %d, head %d\n", track, head);
+
+    trackdensity=cached->density;
+  }
+  else
   {
-    unsigned long count;
-    char level,bi=0;
+    mod_findpeaks(context, cached, sampledata, histogramsize);
+    trackdensity=mod_checkdensity(context);
+
+    if (cached!=NULL)
+      cached->density=trackdensity;
+  }
 
-    mod_samplesize=samplesize;
+  context->density|=trackdensity;
 
-    mod_findpeaks(sampledata, samplesize);
-    mod_checkdensity();
+  __atomic_or_fetch(&mod_density, context->density, __ATOMIC_RELEASE);
+
+  // Decoders are reset for each way of demodulating in use so their last found IDs are current, but only those selected are fed samples
+  //   all those using buckets are fed each interval before those using the PLL
+  context->activecount=0;
+  for (pass=MOD_PASSBUCKET; pass<=MOD_PASSPLL; pass<<=1)
+  {
+    Mod_Decoders *decoders;
 
-    fm_init(mod_debug, mod_density);
-    amigamfm_init(mod_debug, mod_density);
-    mfm_init(mod_debug, mod_density);
-    gcr_init(mod_debug, mod_density);
-    applegcr_init(mod_debug, mod_density);
+    if ((passes&pass)==0)
+      continue;
 
-    // Set up the sampler
-    level=(sampledata[0]&0x80)>>7;
-    bi=level;
-    count=0;
+    decoders=(pass==MOD_PASSPLL)?&context->pll:&context->bucket;
 
-    // Process each byte of the raw flux data
-    for (mod_datapos=0; mod_datapos<samplesize; mod_datapos++)
+    for (i=0; mod_decoders[i].name!=NULL; i++)
     {
-      // Extract byte from buffer
-      c=sampledata[mod_datapos];
+      void *state;
 
-      // Process each bit of the extracted byte
-      for (j=0; j<BITSPERBYTE; j++)
+      state=((char *)decoders)+mod_decoders[i].state;
+
+      mod_decoders[i].init(state, mod_debug, context->density, track, head, rpm);
+
+      if ((mod_decodermask&(1<<i))!=0)
       {
-        // Determine next level
-        bi=((c&0x80)>>7);
-
-        // Increment samples counter
-        count++;
-
-        // Look for level changes
-        if (bi!=level)
-        {
-          // Flip level cache
-          level=1-level;
-
-          // Look for rising edge
-          if (level==1)
-          {
-            fm_addsample(count, mod_datapos, run);
-            amigamfm_addsample(count, mod_datapos, run);
-            mfm_addsample(count, mod_datapos, run);
-            gcr_addsample(count, mod_datapos, run);
-            applegcr_addsample(count, mod_datapos, run);
-
-            // Reset samples counter
-            count=0;
-          }
-        }
-
-        // Move on to next sample level (bit)
-        c=c<<1;
+        context->active[context->activecount]=mod_decoders[i].addsample;
+        context->activestate[context->activecount]=state;
+        context->activepll[context->activecount]=(pass==MOD_PASSPLL);
+        context->activecount++;
       }
     }
   }
+
+  // Set up the sampler
+  context->edge=context->flux->firstrising;
+  context->nextsample=0;
+  context->datapos=0;
+  context->checkedsectors=__atomic_load_n(&diskstore_sectorcount, __ATOMIC_ACQUIRE);
+}
+
+// Demodulate sample data up to the available position, keeping state for the next call
+//   returns 1 once the completion check finds the track to be complete
+int mod_feed(Mod_Context *context, const unsigned long available)
+{
+  Flux_List *flux=context->flux;
+  unsigned long limit, samples, edge, nextsample, datapos;
+  unsigned int i;
+
+  limit=(available<context->samplesize)?available:context->samplesize;
+
+  // Find any more level changes
+  flux_extend(flux, limit);
+
+  // Process each rising edge in the raw flux data, working on local copies of the position
+  nextsample=context->nextsample;
+
+  for (edge=context->edge; edge<flux->count; edge+=2)
+  {
+    if (flux->edges[edge]>=(limit*BITSPERBYTE))
+      break;
+
+    samples=(flux->edges[edge]+1)-nextsample;
+    nextsample=flux->edges[edge]+1;
+    datapos=flux->edges[edge]/BITSPERBYTE;
+
+    for (i=0; i<context->activecount; i++)
+      context->active[i](context->activestate[i], samples, datapos, context->activepll[i]);
+  }
+
+  context->edge=edge;
+  context->nextsample=nextsample;
+  context->datapos=limit;
+
+  // Check for completion when new sectors have been found
+  if (context->completecheck!=NULL)
+  {
+    unsigned int sectorcount=__atomic_load_n(&diskstore_sectorcount, __ATOMIC_ACQUIRE);
+
+    if (sectorcount!=context->checkedsectors)
+    {
+      int complete=context->completecheck(context->track, context->head);
+
+      // Ask again on the next call when the check can't tell yet
+      if (complete>=0)
+        context->checkedsectors=sectorcount;
+
+      return (complete==1);
+    }
+  }
+
+  return 0;
+}
+
+// Set index pulse positions within the sample data to be processed
+void mod_setindexes(Mod_Context *context, const unsigned long *indexes, const unsigned int indexcount)
+{
+  unsigned int i;
+
+  context->indexcount=0;
+
+  if (indexes==NULL)
+    return;
+
+  for (i=0; ((i<indexcount) && (i<HW_MAXINDEXES)); i++)
+    context->indexes[context->indexcount++]=indexes[i];
+}
+
+// Find the start and length of the rotation containing a sample data position
+//   uses the index pulse positions when known, otherwise assumes rotations from the start at the current speed
+void mod_rotation(const Mod_Context *context, const unsigned long datapos, unsigned long *start, unsigned long *length)
+{
+  unsigned long rotation;
+  unsigned int i;
+
+  rotation=(((float)hw_samplerate*SECONDSINMINUTE)/context->rpm)/BITSPERBYTE;
+  if (rotation==0) rotation=1;
+
+  if ((context->indexcount==0) || (datapos<context->indexes[0]))
+  {
+    *start=(datapos/rotation)*rotation;
+    *length=rotation;
+
+    return;
+  }
+
+  // Find the last index pulse at or before this position
+  for (i=0; (((i+1)<context->indexcount) && (context->indexes[i+1]<=datapos)); i++) { }
+
+  *start=context->indexes[i];
+
+  if ((i+1)<context->indexcount)
+    *length=context->indexes[i+1]-context->indexes[i];
+  else
+  if (i>0)
+    *length=context->indexes[i]-context->indexes[i-1];
+  else
+    *length=rotation;
+}
+
+// Set function used to determine when all expected sectors for a track have been found
+//   it returns 1 when complete, 0 when not, or -1 when it can't tell yet and is to be asked again
+void mod_setcompletecheck(Mod_Context *context, int (*check)(const uint8_t track, const uint8_t head))
+{
+  context->completecheck=check;
+}
+
+// Select a single decoder by name, or all of them
+//   returns 0 if not known
+int mod_setdecoder(const char *name)
+{
+  unsigned int i;
+
+  if (strcmp(name, "all")==0)
+  {
+    mod_decodermask=MOD_DECODERSALL;
+    mod_decoderforced=1;
+
+    return 1;
+  }
+
+  for (i=0; mod_decoders[i].name!=NULL; i++)
+  {
+    if (strcmp(mod_decoders[i].name, name)==0)
+    {
+      mod_decodermask=(1<<i);
+      mod_decoderforced=1;
+
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Show available decoders
+void mod_listdecoders(FILE *fp)
+{
+  unsigned int i;
+
+  fprintf(fp, "  %-8s %s\n", "all", "All decoders");
+
+  for (i=0; mod_decoders[i].name!=NULL; i++)
+    fprintf(fp, "  %-8s %s\n", mod_decoders[i].name, mod_decoders[i].description);
+}
+
+// Record which decoders found sector IDs in the sample data just processed
+void mod_addfound(const Mod_Context *context)
+{
+  unsigned int i;
+
+  for (i=0; mod_decoders[i].name!=NULL; i++)
+  {
+    if ((((context->passes&MOD_PASSBUCKET)!=0) && (mod_decoders[i].found(&context->bucket))) ||
+        (((context->passes&MOD_PASSPLL)!=0) && (mod_decoders[i].found(&context->pll))))
+      __atomic_or_fetch(&mod_foundmask, (1<<i), __ATOMIC_RELAXED);
+  }
+}
+
+// Only use the decoders which found sector IDs so far, unless chosen on the command line
+//   returns 1 if the decoders in use were narrowed down
+int mod_selectfound()
+{
+  if ((mod_decoderforced) || (mod_foundmask==0) || (mod_foundmask==mod_decodermask))
+    return 0;
+
+  mod_decodermask=mod_foundmask;
+
+  return 1;
+}
+
+// Show the decoders in use
+void mod_showdecoders(FILE *fp)
+{
+  unsigned int i;
+
+  for (i=0; mod_decoders[i].name!=NULL; i++)
+    if ((mod_decodermask&(1<<i))!=0)
+      fprintf(fp, " %s", mod_decoders[i].name);
+
+  fprintf(fp, "\n");
+}
+
+// Demodulate a whole sample buffer, using the index positions already set for the context
+//   when using the PLL, buckets and PLL are both fed from a single pass over the buffer
+void mod_process(Mod_Context *context, const unsigned char *sampledata, const unsigned long samplesize, const uint8_t track, const uint8_t head, const float rpm, const int attempt, const int usepll)
+{
+  int (*check)(const uint8_t track, const uint8_t head);
+  (void) attempt;
+
+  // Always process the whole buffer
+  check=context->completecheck;
+  context->completecheck=NULL;
+
+  flux_start(context->flux, sampledata);
+
+  mod_start(context, sampledata, samplesize, samplesize, track, head, rpm, (usepll==0)?MOD_PASSBUCKET:(MOD_PASSBUCKET|MOD_PASSPLL));
+  mod_feed(context, samplesize);
+
+  mod_addfound(context);
+
+  // Fuse bad copies from every rotation and earlier attempt into any sectors still missing
+  fusion_recover(track, head);
+
+  // Place the sectors found within their rotations
+  diskstore_placesectors(context);
+
+  context->completecheck=check;
 }
 
 // Initialise modulation
@@ -313,5 +596,8 @@ void mod_init(const int debug)
 {
   mod_debug=debug;
 
-  mod_peaks=0;
+  mod_initcontext(&mod_context, &flux_list);
+
+  applegcr_buildgcrdecodemaps();
+  gcr_builddecodemap();
 }
@@ -1,6 +1,18 @@
 #ifndef _MOD_H_
 #define _MOD_H_
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hardware.h"
+#include "flux.h"
+#include "fm.h"
+#include "mfm.h"
+#include "amigamfm.h"
+#include "gcr.h"
+#include "applegcr.h"
+
 #define MOD_HISTOGRAMSIZE 512
 #define MOD_PEAKSIZE 5
 
@@ -11,11 +23,118 @@
 #define MOD_DENSITYMFMED 8
 #define MOD_DENSITYAPPLEGCR 16
 
-extern unsigned long mod_datapos;
+// Maximum number of registered decoders
+#define MOD_MAXDECODERS 8
+
+// Decoder selection, as a mask of decoders in registry order
+#define MOD_DECODERSALL ((1<<MOD_MAXDECODERS)-1)
+
+// Ways of demodulating, as a mask, each decoder in use is fed by all of them in the same pass
+#define MOD_PASSBUCKET 1
+#define MOD_PASSPLL 2
+
+// Maximum number of decoders fed at once, each decoder once per way of demodulating
+#define MOD_MAXACTIVE (MOD_MAXDECODERS*2)
+
+// Decoder entry points, passed their own state from within a Mod_Decoders
+typedef void (*Mod_Init)(void *state, const int debug, const char density, const uint8_t track, const uint8_t head, const float rpm);
+typedef void (*Mod_AddSample)(void *state, const unsigned long samples, const unsigned long datapos, const int usepll);
+
+// State of every decoder, one set for each way of demodulating
+typedef struct ModDecoders
+{
+  FM_Context fm;
+  AmigaMFM_Context amigamfm;
+  MFM_Context mfm;
+  GCR_Context gcr;
+  AppleGCR_Context applegcr;
+} Mod_Decoders;
+
+// Intervals seen on a physical track/head across every capture of it, and the densities found from them
+typedef struct ModTrack
+{
+  unsigned long counts[MOD_HISTOGRAMSIZE];
+  char density;
+} Mod_Track;
+
+// Demodulation state, one per piece of sample data being decoded at the same time
+typedef struct ModContext
+{
+  // Physical position and speed the sample data being processed was captured with
+  uint8_t track;
+  uint8_t head;
+  float rpm;
+
+  // Level changes found in the sample data
+  Flux_List *flux;
+
+  // Position reached, kept between calls to mod_feed()
+  unsigned long samplesize;
+  int passes;
+  unsigned long edge;
+  unsigned long nextsample;
+  unsigned long datapos;
+  unsigned int checkedsectors;
+  int (*completecheck)(const uint8_t track, const uint8_t head);
+
+  // Index pulse positions within the sample data
+  unsigned long indexes[HW_MAXINDEXES];
+  unsigned int indexcount;
+
+  // Intervals counted from this sample data so far, kept between calls to mod_start() until the flux list is restarted
+  unsigned long counts[MOD_HISTOGRAMSIZE];
+  unsigned long histgeneration;
+  unsigned long histedge;
+  unsigned long histnext;
+
+  // Histogram of samples between rising edges, and the peaks found in it
+  unsigned long hist[MOD_HISTOGRAMSIZE];
+  int peak[MOD_PEAKSIZE];
+  int peaks;
+  char density;
+
+  // Sample handlers for the decoders in use along with their state and whether to use the PLL, set up by mod_start()
+  Mod_AddSample active[MOD_MAXACTIVE];
+  void *activestate[MOD_MAXACTIVE];
+  int activepll[MOD_MAXACTIVE];
+  unsigned int activecount;
+
+  // Decoders fed by bucketing intervals, and by the PLL
+  Mod_Decoders bucket;
+  Mod_Decoders pll;
+} Mod_Context;
+
+typedef struct ModDecoder
+{
+  const char *name;
+  const char *description;
+
+  // Offset of this decoder's state within a Mod_Decoders
+  size_t state;
+
+  Mod_Init init;
+  Mod_AddSample addsample;
+
+  // Check if any sector IDs were found since init
+  int (*found)(const Mod_Decoders *decoders);
+} Mod_Decoder;
+
+// Separate 16 cells into clock (odd) and data (even) bytes, using a table of even bits
+#define MOD_GETCLOCK(cells) ((mod_evenbits[((cells)>>9)&0x7f]<<4)|mod_evenbits[((cells)>>1)&0xff])
+#define MOD_GETDATA(cells) ((mod_evenbits[((cells)>>8)&0xff]<<4)|mod_evenbits[(cells)&0xff])
+
+// Get a group of 16 cells from a 64 cell sliding window, 0 being the most recent
+#define MOD_CELLS(window, group) ((unsigned int)(((window)>>((group)*16))&0xffff))
+
+extern const unsigned char mod_evenbits[256];
+
+// Demodulation state for the sample data being processed on the main thread
+extern Mod_Context mod_context;
+
+// Size of the sample buffers being captured
 extern unsigned long mod_samplesize;
 
-extern int mod_peak[MOD_PEAKSIZE];
-extern int mod_peaks;
+// Densities detected on any track so far
 extern char mod_density;
 
 unsigned char mod_getclock(const unsigned int datacells);
@@ -23,7 +142,20 @@ unsigned char mod_getdata(const unsigned int datacells);
 
 extern float mod_samplestous(const long samples);
 
-extern void mod_process(const unsigned char *sampledata, const unsigned long samplesize, const int attempt, const int usepll);
+extern void mod_initcontext(Mod_Context *context, Flux_List *flux);
+
+extern void mod_start(Mod_Context *context, const unsigned char *sampledata, const unsigned long samplesize, const unsigned long histogramsize, const uint8_t track, const uint8_t head, const float rpm, const int passes);
+extern int mod_feed(Mod_Context *context, const unsigned long available);
+extern void mod_setindexes(Mod_Context *context, const unsigned long *indexes, const unsigned int indexcount);
+extern void mod_rotation(const Mod_Context *context, const unsigned long datapos, unsigned long *start, unsigned long *length);
+extern void mod_setcompletecheck(Mod_Context *context, int (*check)(const uint8_t track, const uint8_t head));
+
+extern int mod_setdecoder(const char *name);
+extern void mod_listdecoders(FILE *fp);
+extern int mod_selectfound();
+extern void mod_showdecoders(FILE *fp);
+
+extern void mod_process(Mod_Context *context, const unsigned char *sampledata, const unsigned long samplesize, const uint8_t track, const uint8_t head, const float rpm, const int attempt, const int usepll);
 
 extern void mod_init(const int debug);
 
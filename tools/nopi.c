@@ -2,12 +2,15 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
 
 #include "common.h"
 #include "hardware.h"
+#include "arena.h"
 #include "rfi.h"
 #include "scp.h"
 #include "hfe.h"
@@ -24,9 +27,50 @@ float hw_rpm = HW_DEFAULTRPM;
 
 int hw_stepping = HW_NORMALSTEPPING;
 
+// Time in milliseconds between step pulses, and number of steps made
+unsigned int hw_steprate = HW_MAXSTEPRATE;
+unsigned long hw_stepcount = 0;
+
+// Amount of the current sample buffer which is ready for processing
+unsigned long hw_sampledbytes = 0;
+
+// When set, sampling finishes early once this becomes non-zero
+int *hw_samplestop = NULL;
+
+// Sample buffer positions of index pulses seen during the last capture
+unsigned long hw_indexpos[HW_MAXINDEXES];
+unsigned int hw_indexcount = 0;
+
 FILE *hw_samplefile = NULL;
 char hw_samplefilename[1024];
 
+// When set, emulate the time taken by real drive operations
+int hw_emulatetiming = 0;
+
+// Get current time in microseconds
+unsigned long long hw_emulatetime()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (((unsigned long long)tv.tv_sec)*USINSECOND)+tv.tv_usec;
+}
+
+// Wait for a number of microseconds, when emulating drive timings
+void hw_emulatedelay(const unsigned long long us)
+{
+  struct timespec ts;
+
+  if (hw_emulatetiming==0)
+    return;
+
+  ts.tv_sec=us/USINSECOND;
+  ts.tv_nsec=(us%USINSECOND)*NSINUS;
+
+  nanosleep(&ts, NULL);
+}
+
 // Drive control
 unsigned char hw_detectdisk()
 {
@@ -64,12 +108,23 @@ int hw_attrackzero()
 // Seek to track zero
 void hw_seektotrackzero()
 {
+  hw_emulatedelay((10+(hw_currenttrack*hw_steprate))*1000);
+
+  hw_stepcount+=hw_currenttrack;
   hw_currenttrack=0;
 }
 
 // Seek to given track number
 void hw_seektotrack(const int track)
 {
+  int steps;
+
+  steps=(track*hw_stepping)-hw_currenttrack;
+  if (steps<0) steps=-steps;
+
+  hw_emulatedelay(steps*hw_steprate*1000);
+  hw_stepcount+=steps;
+
   // Actual seeking within input file will be done by sampling function
   hw_currenttrack=track*hw_stepping;
 }
@@ -80,15 +135,30 @@ void hw_setmaxtracks(const int maxtracks)
   hw_maxtracks=maxtracks;
 }
 
+// Set time between step pulses, as fast as the drive allows
+void hw_setsteprate(const unsigned int ms)
+{
+  if ((ms>0) && (ms<=HW_MAXSTEPRATE))
+    hw_steprate=ms;
+  else
+    hw_steprate=HW_MAXSTEPRATE;
+}
+
 // Seek head in by 1 track
 void hw_seekin()
 {
+  hw_emulatedelay(hw_steprate*1000);
+  hw_stepcount++;
+
   if (hw_currenttrack<hw_maxtracks) hw_currenttrack++;
 }
 
 // Seek head out by 1 track, towards track zero
 void hw_seekout()
 {
+  hw_emulatedelay(hw_steprate*1000);
+  hw_stepcount++;
+
   if (hw_currenttrack>0) hw_currenttrack--;
 }
 
@@ -101,7 +171,15 @@ void hw_sideselect(const int side)
 // Wait for an index pulse to synchronise capture
 void hw_waitforindex()
 {
-  // Only used to sync sampling, so ignore for now
+  unsigned long long rotation;
+
+  // Only used to sync sampling, so only wait when emulating timings
+  if (hw_emulatetiming==0)
+    return;
+
+  // Index pulses are emulated as occurring once per rotation since the epoch
+  rotation=(SECONDSINMINUTE*USINSECOND)/hw_rpm;
+  hw_emulatedelay(rotation-(hw_emulatetime()%rotation));
 }
 
 // Determine if disk is write protected
@@ -116,58 +194,14 @@ int hw_writeprotected()
   return 0;
 }
 
-// Fix SPI sample buffer timings
-void hw_fixspisamples(unsigned char *inbuf, long inlen, unsigned char *outbuf, long outlen)
-{
-  long inpos, outpos;
-  unsigned char o, olen, bitpos;
-
-  outpos=0; o=0; olen=0;
-
-  for (inpos=0; inpos<inlen; inpos++)
-  {
-    unsigned char c;
-
-    c=inbuf[inpos];
-
-    // Insert extra sample, this is due to SPI sampling leaving a 1 sample gap between each group of 8 samples
-    o=(o<<1)|((c&0x80)>>7);
-    olen++;
-    if (olen==BITSPERBYTE)
-    {
-      if (outpos<outlen)
-        outbuf[outpos++]=o;
-
-      olen=0; o=0;
-    }
-
-    // Process the 8 valid samples we did get
-    for (bitpos=0; bitpos<BITSPERBYTE; bitpos++)
-    {
-      o=(o<<1)|((c&0x80)>>7);
-      olen++;
-
-      if (olen==BITSPERBYTE)
-      {
-        if (outpos<outlen)
-          outbuf[outpos++]=o;
-
-        olen=0; o=0;
-      }
-
-      c=c<<1;
-    }
-
-    // Stop on output buffer overflow
-    if (outpos>=outlen) return;
-  }
-}
-
 // Read raw flux data for current track/head
 void hw_samplerawtrackdata(unsigned char* buf, uint32_t len)
 {
+  unsigned long pos;
+
   // Clear output buffer to prevent failed reads potentially returning previous data
   bzero(buf, len);
+  __atomic_store_n(&hw_sampledbytes, 0, __ATOMIC_RELEASE);
 
   // Find/Read track data into buffer
   if (hw_samplefile!=NULL)
@@ -179,18 +213,18 @@ void hw_samplerawtrackdata(unsigned char* buf, uint32_t len)
       {
         unsigned char *rawbuf;
 
-        rawbuf=malloc(HW_OLDRAWTRACKSIZE);
+        rawbuf=arena_borrow(ARENA_READSCRATCH, HW_OLDRAWTRACKSIZE);
         if (rawbuf==NULL) return;
 
         if (fread(rawbuf, HW_OLDRAWTRACKSIZE, 1, hw_samplefile)==0)
         {
-          free(rawbuf);
+          arena_release(ARENA_READSCRATCH, rawbuf);
           return;
         }
 
         hw_fixspisamples(rawbuf, HW_OLDRAWTRACKSIZE, buf, len);
 
-        free(rawbuf);
+        arena_release(ARENA_READSCRATCH, rawbuf);
       }
     }
     else
@@ -209,6 +243,35 @@ void hw_samplerawtrackdata(unsigned char* buf, uint32_t len)
     if (compare_extension(hw_samplefilename, ".woz"))
       woz_readtrack(hw_samplefile, hw_currenttrack, hw_currenthead, buf, len);
   }
+
+  // Index pulses are at the start of the sample data, then once per rotation at the track's speed
+  hw_indexcount=0;
+  if ((hw_rpm>0) && (hw_samplerate>0))
+  {
+    unsigned long rotation;
+
+    rotation=(((float)hw_samplerate*SECONDSINMINUTE)/hw_rpm)/BITSPERBYTE;
+
+    for (pos=0; ((rotation>0) && (pos<len) && (hw_indexcount<HW_MAXINDEXES)); pos+=rotation)
+      hw_indexpos[hw_indexcount++]=pos;
+  }
+
+  // Emulate time taken to sample the track, handing over a block at a time
+  hw_waitforindex();
+  if (hw_emulatetiming)
+  {
+    for (pos=HW_SPIBLOCKSIZE; pos<len; pos+=HW_SPIBLOCKSIZE)
+    {
+      hw_emulatedelay((((unsigned long long)HW_SPIBLOCKSIZE)*BITSPERBYTE*USINSECOND)/hw_samplerate);
+      __atomic_store_n(&hw_sampledbytes, pos, __ATOMIC_RELEASE);
+
+      // Stop early if requested
+      if ((hw_samplestop!=NULL) && (__atomic_load_n(hw_samplestop, __ATOMIC_ACQUIRE)!=0))
+        return;
+    }
+  }
+
+  __atomic_store_n(&hw_sampledbytes, len, __ATOMIC_RELEASE);
 }
 
 // Clean up
@@ -285,13 +348,37 @@ int hw_init(const char *rawfile, const int spiclockdivider)
 // Sleep for a number of seconds
 void hw_sleep(const unsigned int seconds)
 {
-  (void) seconds;
+  // No sleep required as this is not using real hardware, unless emulating timings
+  hw_emulatedelay(((unsigned long long)seconds)*USINSECOND);
+}
 
-  // No sleep required as this is not using real hardware
+// Wait for a number of milliseconds
+void hw_delay(const unsigned int ms)
+{
+  hw_emulatedelay(((unsigned long long)ms)*1000);
+}
+
+// Determine RPM from the average spacing of index pulses within sample data
+float hw_indexrpm(const unsigned long *indexes, const unsigned int indexcount)
+{
+  unsigned long rotation;
+
+  if ((indexes==NULL) || (indexcount<2))
+    return 0;
+
+  rotation=(indexes[indexcount-1]-indexes[0])/(indexcount-1);
+  if (rotation==0)
+    return 0;
+
+  return ((float)hw_samplerate*SECONDSINMINUTE)/((float)rotation*BITSPERBYTE);
 }
 
 // Measure RPM, defaults to 300RPM
 float hw_measurerpm()
 {
+  // Emulate time taken waiting for two index pulses
+  hw_waitforindex();
+  hw_waitforindex();
+
   return hw_rpm;
 }
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "pll.h"
 
@@ -12,8 +13,9 @@ float pll_phaseadjust=(65.0/100.0);
 float pll_minperiod=(75.0/100.0);
 float pll_maxperiod=(125.0/100.0);
 
-// Linked list of all the assigned PLLs
+// Linked list of all the assigned PLLs, guarded as decoders may be set up by several threads
 struct PLL *PLL_root=NULL;
+pthread_mutex_t PLL_lock=PTHREAD_MUTEX_INITIALIZER;
 
 // Reset a PLL entry
 void PLL_reset(struct PLL *pll, const float bitcell)
@@ -33,7 +35,7 @@ void PLL_reset(struct PLL *pll, const float bitcell)
 }
 
 // Create a new PLL entity
-struct PLL *PLL_create(const float bitcell, void (*callback))
+struct PLL *PLL_create(const float bitcell, void (*callback), void *context)
 {
   struct PLL *newpll;
 
@@ -44,9 +46,12 @@ struct PLL *PLL_create(const float bitcell, void (*callback))
     PLL_reset(newpll, bitcell);
 
     newpll->callback=callback;
+    newpll->context=context;
     newpll->nextpll=NULL;
 
     // Store this PLL instance for later cleanup
+    pthread_mutex_lock(&PLL_lock);
+
     if (PLL_root!=NULL)
     {
       struct PLL *rover;
@@ -59,92 +64,110 @@ struct PLL *PLL_create(const float bitcell, void (*callback))
     }
     else
       PLL_root=newpll;
+
+    pthread_mutex_unlock(&PLL_lock);
   }
 
   return newpll;
 }
 
+// Finish the bit cell ending at the current position, it's a 1 if a transition was seen within it
+void PLL_endcell(struct PLL *pll, const unsigned long datapos)
+{
+  pll->next=(pll->cur_pos+pll->period+pll->phase_adjust);
+  (pll->callback)(pll->context, (pll->num_bits>0?1:0), datapos);
+
+  pll->num_bits=0;
+}
+
 // Add a sample to the PLL processor
+//   rather than stepping one sample at a time, jumps straight to each cell boundary within the interval,
+//   then to the rising edge at the end of it, giving the same cells as stepping would
 void PLL_addsample(struct PLL *pll, const unsigned long samples, const unsigned long datapos)
 {
-  unsigned long i=samples;
+  uint32_t edgepos;
 
-  if (pll==NULL) return;
+  if ((pll==NULL) || (samples==0)) return;
+
+  // The rising edge is processed one sample before the end of the interval
+  edgepos=pll->cur_pos+(samples-1);
 
-  while (i>0)
+  // Cells ending before the rising edge, each boundary is the first position at or after the expected one
+  while (1)
   {
-    i--;
+    uint32_t boundary;
 
-    // Processing for rising edge
-    if (i==0)
+    boundary=(pll->next>pll->cur_pos)?pll->next:(pll->cur_pos+1);
+    if (boundary>edgepos)
+      break;
+
+    pll->cur_pos=boundary;
+    PLL_endcell(pll, datapos);
+  }
+
+  pll->cur_pos=edgepos;
+
+  // Processing for rising edge
+  if (pll->cur_pos>=pll->next)
+  {
+    // No transition in the window means 0 and pll in free run mode
+    pll->phase_adjust=0;
+  }
+  else
+  {
+    // Transition in the window means 1, and the pll is adjusted
+    float delta=pll->cur_pos-(pll->next-(pll->period/2));
+    pll->phase_adjust=pll_phaseadjust*delta;
+
+    pll->num_bits++;
+
+    // Adjust frequency based on error
+    if (delta<0)
     {
-      if (pll->cur_pos>=pll->next)
-      {
-        // No transition in the window means 0 and pll in free run mode
-        pll->phase_adjust=0;
-      }
+      if (pll->freq_hist<0)
+        pll->freq_hist--;
       else
-      {
-        // Transition in the window means 1, and the pll is adjusted
-        float delta=pll->cur_pos-(pll->next-(pll->period/2));
-        pll->phase_adjust=pll_phaseadjust*delta;
-
-        pll->num_bits++;
-
-        // Adjust frequency based on error
-        if (delta<0)
-        {
-          if (pll->freq_hist<0)
-            pll->freq_hist--;
-          else
-            pll->freq_hist=-1;
-        }
-        else
-        if (delta>0)
-        {
-          if (pll->freq_hist>0)
-            pll->freq_hist++;
-          else
-            pll->freq_hist=1;
-        }
-        else
-          pll->freq_hist=0;
-
-        // Update the reference clock?
-        if (pll->freq_hist)
-        {
-          int afh=pll->freq_hist<0?-pll->freq_hist:pll->freq_hist;
-
-          if (afh>1)
-          {
-            float aper=pll->period_adjust_base*delta/pll->period;
-
-            if (!aper)
-              aper=pll->freq_hist<0?-1:1;
-
-            pll->period+=aper;
-
-            // Keep within bounds
-            if (pll->period<pll->min_period)
-              pll->period=pll->min_period;
-            else
-            if (pll->period>pll->max_period)
-              pll->period=pll->max_period;
-          }
-        }
-      }
+        pll->freq_hist=-1;
     }
+    else
+    if (delta>0)
+    {
+      if (pll->freq_hist>0)
+        pll->freq_hist++;
+      else
+        pll->freq_hist=1;
+    }
+    else
+      pll->freq_hist=0;
 
-    pll->cur_pos++;
-
-    if (pll->cur_pos>=pll->next)
+    // Update the reference clock?
+    if (pll->freq_hist)
     {
-      pll->next=(pll->cur_pos+pll->period+pll->phase_adjust);
-      (pll->callback)((pll->num_bits>0?1:0), datapos);
+      int afh=pll->freq_hist<0?-pll->freq_hist:pll->freq_hist;
+
+      if (afh>1)
+      {
+        float aper=pll->period_adjust_base*delta/pll->period;
+
+        if (!aper)
+          aper=pll->freq_hist<0?-1:1;
+
+        pll->period+=aper;
 
-      pll->num_bits=0;
+        // Keep within bounds
+        if (pll->period<pll->min_period)
+          pll->period=pll->min_period;
+        else
+        if (pll->period>pll->max_period)
+          pll->period=pll->max_period;
+      }
     }
   }
+
+  pll->cur_pos++;
+
+  if (pll->cur_pos>=pll->next)
+    PLL_endcell(pll, datapos);
 }
 
 void PLL_done()
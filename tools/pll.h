@@ -19,7 +19,8 @@ struct PLL
 
   uint32_t num_bits; // Number of bits observed within current bit cell
 
-  void (*callback)(const unsigned long samples, const unsigned long datapos); // Function to send recovered bits to
+  void (*callback)(void *context, const unsigned char bit, const unsigned long datapos); // Function to send recovered bits to
+  void *context; // Decoder state passed to the callback
 
   void *nextpll; // Pointer to the next PLL for cleanup purposes
 };
@@ -30,7 +31,7 @@ extern float pll_minperiod;
 extern float pll_maxperiod;
 
 extern void PLL_init();
-extern struct PLL *PLL_create(const float bitcell, void *callback);
+extern struct PLL *PLL_create(const float bitcell, void *callback, void *context);
 extern void PLL_reset(struct PLL *pll, const float bitcell);
 extern void PLL_addsample(struct PLL *pll, const unsigned long samples, const unsigned long datapos);
 
@@ -0,0 +1,122 @@
+#include <pthread.h>
+
+#include "pool.h"
+
+// Jobs waiting to be run by each worker, as a range of job numbers
+//   the owner takes jobs from the start, other workers steal from the end
+typedef struct PoolQueue
+{
+  pthread_mutex_t lock;
+  unsigned int start;
+  unsigned int end;
+} Pool_Queue;
+
+Pool_Queue pool_queues[POOL_MAXWORKERS];
+unsigned int pool_workers=0;
+Pool_Job pool_handler=NULL;
+
+// Take the next job from a worker's own queue
+//   returns 0 if the queue is empty
+int pool_take(const unsigned int worker, unsigned int *job)
+{
+  Pool_Queue *queue=&pool_queues[worker];
+  int taken=0;
+
+  pthread_mutex_lock(&queue->lock);
+
+  if (queue->start<queue->end)
+  {
+    *job=queue->start++;
+    taken=1;
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+
+  return taken;
+}
+
+// Move the later half of another worker's remaining jobs onto this worker's queue
+//   returns 0 once there is nothing left to steal
+int pool_steal(const unsigned int worker)
+{
+  unsigned int i;
+
+  for (i=1; i<pool_workers; i++)
+  {
+    Pool_Queue *victim=&pool_queues[(worker+i)%pool_workers];
+    unsigned int start, end;
+
+    pthread_mutex_lock(&victim->lock);
+
+    end=victim->end;
+    start=victim->start+((victim->end-victim->start)/2);
+    victim->end=start;
+
+    pthread_mutex_unlock(&victim->lock);
+
+    if (start<end)
+    {
+      pthread_mutex_lock(&pool_queues[worker].lock);
+      pool_queues[worker].start=start;
+      pool_queues[worker].end=end;
+      pthread_mutex_unlock(&pool_queues[worker].lock);
+
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Run jobs until there are none left on any queue
+void *pool_worker(void *arg)
+{
+  unsigned int worker=(Pool_Queue *)arg-pool_queues;
+  unsigned int job;
+
+  while (1)
+  {
+    if (pool_take(worker, &job))
+      pool_handler(worker, job);
+    else
+    if (!pool_steal(worker))
+      break;
+  }
+
+  return NULL;
+}
+
+// Run a number of jobs across worker threads, returning once they have all completed
+//   jobs are initially shared out in blocks, workers which run out steal from the others
+void pool_run(const unsigned int workers, const unsigned int jobcount, Pool_Job handler)
+{
+  pthread_t threads[POOL_MAXWORKERS];
+  int started[POOL_MAXWORKERS];
+  unsigned int worker;
+
+  pool_workers=workers;
+  if (pool_workers>POOL_MAXWORKERS) pool_workers=POOL_MAXWORKERS;
+  if (pool_workers<1) pool_workers=1;
+
+  pool_handler=handler;
+
+  for (worker=0; worker<pool_workers; worker++)
+  {
+    pthread_mutex_init(&pool_queues[worker].lock, NULL);
+    pool_queues[worker].start=(jobcount*worker)/pool_workers;
+    pool_queues[worker].end=(jobcount*(worker+1))/pool_workers;
+  }
+
+  // The calling thread is the first worker, any jobs left by threads which fail to start get stolen
+  for (worker=1; worker<pool_workers; worker++)
+    started[worker]=(pthread_create(&threads[worker], NULL, pool_worker, &pool_queues[worker])==0);
+
+  pool_worker(&pool_queues[0]);
+
+  for (worker=1; worker<pool_workers; worker++)
+    if (started[worker])
+      pthread_join(threads[worker], NULL);
+
+  for (worker=0; worker<pool_workers; worker++)
+    pthread_mutex_destroy(&pool_queues[worker].lock);
+}
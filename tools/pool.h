@@ -0,0 +1,12 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+// Maximum number of worker threads
+#define POOL_MAXWORKERS 16
+
+// Job handler, passed the worker running it and the job number
+typedef void (*Pool_Job)(const unsigned int worker, const unsigned int job);
+
+extern void pool_run(const unsigned int workers, const unsigned int jobcount, Pool_Job handler);
+
+#endif
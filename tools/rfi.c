@@ -8,6 +8,8 @@
 #include "hardware.h"
 #include "rfi.h"
 #include "jsmn.h"
+#include "arena.h"
+#include "flux.h"
 
 char *rfi_headerstring = NULL;
 unsigned int rfi_headerlen = 0;
@@ -171,51 +173,41 @@ int rfi_readheader(FILE *rfifile)
 unsigned long rfi_rleencode(unsigned char *rlebuffer, const unsigned long maxrlelen, const unsigned char *rawtrackdata, const unsigned long rawdatalength)
 {
   unsigned long rlelen=0;
-  char state=0;
-  unsigned int i, j;
-  int count=0;
+  unsigned long edge, nextsample, count;
 
-  // Determine starting sample level
-  state=(rawtrackdata[0]&0x80)>>7;
+  flux_build(&flux_list, rawtrackdata, rawdatalength);
 
   // If not starting at zero, then record a 0 count
-  if (state!=0)
+  if (flux_list.firstrising!=0)
     rlebuffer[rlelen++]=0;
 
-  for (i=0; i<rawdatalength; i++)
+  // Record the number of samples at each level, up to and including the sample where it changes
+  nextsample=0;
+  for (edge=0; edge<=flux_list.count; edge++)
   {
-    unsigned char c;
-
-    c=rawtrackdata[i];
+    if (edge<flux_list.count)
+      count=(flux_list.edges[edge]+1)-nextsample;
+    else
+      count=(rawdatalength*BITSPERBYTE)-nextsample; // Samples after the last change
 
-    // Process each of the 8 sample bits looking for state change
-    for (j=0; j<8; j++)
+    // Runs which are too long are split, with the sample causing the split being dropped
+    while (count>0xff)
     {
-      count++;
-
-      if (count>0xff)
-      {
-        // Check for RLE buffer overflow
-        if ((rlelen+2)>=maxrlelen) return 0;
-
-        rlebuffer[rlelen++]=0xff;
-        rlebuffer[rlelen++]=0;
-        count=0;
-      }
+      // Check for RLE buffer overflow
+      if ((rlelen+2)>=maxrlelen) return 0;
 
-      if (((c&0x80)>>7)!=state)
-      {
-        state=1-state;
+      rlebuffer[rlelen++]=0xff;
+      rlebuffer[rlelen++]=0;
+      count-=0x100;
+    }
 
-        // Check for RLE buffer overflow
-        if ((rlelen+1)>=maxrlelen) return 0;
+    if (edge==flux_list.count) break;
 
-        rlebuffer[rlelen++]=count;
-        count=0;
-      }
+    // Check for RLE buffer overflow
+    if ((rlelen+1)>=maxrlelen) return 0;
 
-      c=c<<1;
-    }
+    rlebuffer[rlelen++]=count;
+    nextsample=flux_list.edges[edge]+1;
   }
 
   return rlelen;
@@ -238,7 +230,7 @@ void rfi_writetrack(FILE *rfifile, const int track, const int side, const float
   {
     unsigned char *rledata;
 
-    rledata=malloc(rawdatalength);
+    rledata=arena_borrow(ARENA_WRITESCRATCH, rawdatalength);
 
     if (rledata!=NULL)
     {
@@ -249,7 +241,7 @@ void rfi_writetrack(FILE *rfifile, const int track, const int side, const float
       fprintf(rfifile, "enc:\"%s\",len:%lu}", encoding, rledatalength);
       fwrite(rledata, 1, rledatalength, rfifile);
 
-      free(rledata);
+      arena_release(ARENA_WRITESCRATCH, rledata);
     }
     else
     {
@@ -423,14 +415,14 @@ long rfi_readtrack(FILE *rfifile, const int track, const int side, unsigned char
           long rlen=0;
           char *rlebuff;
 
-          rlebuff=malloc(rfi_trackdatalen);
+          rlebuff=arena_borrow(ARENA_READSCRATCH, rfi_trackdatalen);
 
           if (rlebuff==NULL) return 0;
 
           blen=0; s=0; b=0;
           if (fread(rlebuff, rfi_trackdatalen, 1, rfifile)==0)
           {
-            free(rlebuff);
+            arena_release(ARENA_READSCRATCH, rlebuff);
             return 0;
           }
 
@@ -453,7 +445,7 @@ long rfi_readtrack(FILE *rfifile, const int track, const int side, unsigned char
                 // Check for unpacking overflow
                 if (rlen>=buflen)
                 {
-                  free(rlebuff);
+                  arena_release(ARENA_READSCRATCH, rlebuff);
                   return rlen;
                 }
 
@@ -468,7 +460,7 @@ long rfi_readtrack(FILE *rfifile, const int track, const int side, unsigned char
             s=1-s;
           }
 
-          free(rlebuff);
+          arena_release(ARENA_READSCRATCH, rlebuff);
 
           return rlen;
         }
@@ -10,6 +10,7 @@
 #include "hardware.h"
 #include "scp.h"
 #include "mod.h"
+#include "flux.h"
 
 /*
 
@@ -502,15 +503,38 @@ void scp_writeheader(FILE *scpfile, const uint8_t rotations, const uint8_t start
     fprintf(scpfile, "%c%c%c%c", 0, 0, 0, 0);
 }
 
-void scp_writetrack(FILE *scpfile, const uint8_t track, const unsigned char *rawtrackdata, const unsigned long rawdatalength, const uint8_t rotations, const float rpm)
+// Find where a rotation starts and ends within the raw data, using index pulse positions where known
+void scp_rotationbounds(const uint8_t rotation, const unsigned long rawdatalength, const uint8_t rotations, const unsigned long *indexes, const unsigned int indexcount, unsigned long *start, unsigned long *end)
+{
+  unsigned long rotpoint;
+
+  rotpoint=rawdatalength/rotations;
+
+  if ((indexes!=NULL) && (rotation<indexcount))
+    *start=indexes[rotation];
+  else
+    *start=rotpoint*rotation;
+
+  if ((indexes!=NULL) && ((unsigned int)(rotation+1)<indexcount))
+    *end=indexes[rotation+1];
+  else
+  if ((rotation+1)==rotations)
+    *end=rawdatalength;
+  else
+    *end=rotpoint*(rotation+1);
+
+  if (*end>rawdatalength) *end=rawdatalength;
+  if (*start>*end) *start=*end;
+}
+
+void scp_writetrack(FILE *scpfile, const uint8_t track, const unsigned char *rawtrackdata, const unsigned long rawdatalength, const uint8_t rotations, const unsigned long *indexes, const unsigned int indexcount, const float rpm)
 {
   long scppos;
   uint8_t i;
-  unsigned char c,j;
-  unsigned long fluxdatapos;
+  unsigned long edge;
   float celltime;
   uint32_t value;
-  unsigned long rotpoint;
+  unsigned long startpos, endpos;
   struct scp_tdh tdh;
   struct scp_timings timings;
 
@@ -527,13 +551,14 @@ void scp_writetrack(FILE *scpfile, const uint8_t track, const unsigned char *raw
   // Write the track header
   fwrite(&tdh, 1, sizeof(tdh), scpfile);
 
-  rotpoint=rawdatalength/rotations;
-
   // Write track timings
   for (i=0; i<rotations; i++)
   {
-    // Index time - duration of first revolution between index pulses (in nanoseconds/25)
-    timings.indextime=(1/(rpm/SECONDSINMINUTE))*(NSINSECOND/SCP_BASE_NS);
+    // Index time - duration of revolution between index pulses (in nanoseconds/25)
+    if ((indexes!=NULL) && ((unsigned int)(i+1)<indexcount) && (hw_samplerate>0))
+      timings.indextime=(((unsigned long long)(indexes[i+1]-indexes[i]))*BITSPERBYTE*(NSINSECOND/SCP_BASE_NS))/hw_samplerate;
+    else
+      timings.indextime=(1/(rpm/SECONDSINMINUTE))*(NSINSECOND/SCP_BASE_NS);
 
     // Track length (in bitcells)
     timings.tracklen=0;
@@ -544,6 +569,10 @@ void scp_writetrack(FILE *scpfile, const uint8_t track, const unsigned char *raw
     fwrite(&timings, 1, sizeof(timings), scpfile);
   }
 
+  // Find the flux transitions
+  flux_build(&flux_list, rawtrackdata, rawdatalength);
+  edge=flux_list.firstrising;
+
   // Split raw data into rotations
   for (i=0; i<rotations; i++)
   {
@@ -551,67 +580,47 @@ void scp_writetrack(FILE *scpfile, const uint8_t track, const unsigned char *raw
     long trackpos;
     uint32_t fluxtime;
     uint32_t numfluxes;
-    char level,bi=0;
+    unsigned long startsample, endsample, nextsample;
 
-    // 16 bit big-endian time in nanoseconds/25 between fluxes
-    level=(rawtrackdata[rotpoint*i]&0x80)>>7;
-    bi=level;
-    fluxtime=0;
+    // Each rotation is timed from its own first sample
+    scp_rotationbounds(i, rawdatalength, rotations, indexes, indexcount, &startpos, &endpos);
+    startsample=startpos*BITSPERBYTE;
+    endsample=endpos*BITSPERBYTE;
+
+    nextsample=startsample;
     numfluxes=0;
 
     scpdatapos=ftell(scpfile);
 
-    // Process each byte of the raw flux data
-    for (fluxdatapos=(rotpoint*i); ((fluxdatapos<rotpoint*(i+1)) && (fluxdatapos<rawdatalength)); fluxdatapos++)
-    {
-      // Extract byte from buffer
-      c=rawtrackdata[fluxdatapos];
-
-      // Process each bit of the extracted byte
-      for (j=0; j<BITSPERBYTE; j++)
-      {
-        // Determine next level
-        bi=((c&0x80)>>7);
+    // Skip any rising edge on the first sample of the rotation
+    while ((edge<flux_list.count) && (flux_list.edges[edge]<=startsample))
+      edge+=2;
 
-        // Increment samples counter
-        fluxtime++;
-
-        // Look for level changes
-        if (bi!=level)
-        {
-          // Flip level cache
-          level=1-level;
-
-          // Look for rising edge
-          if (level==1)
-          {
-            // Increment total number of fluxes
-            numfluxes++;
-
-            // Convert samples into nanoseconds/25
-            celltime=(mod_samplestous(fluxtime)*NSINUS)/SCP_BASE_NS;
-
-            // Convert back from float to uint16_t
-            fluxtime=roundf(celltime);
+    // 16 bit big-endian time in nanoseconds/25 between fluxes
+    for (; ((edge<flux_list.count) && (flux_list.edges[edge]<endsample)); edge+=2)
+    {
+      // Increment total number of fluxes
+      numfluxes++;
 
-            // Check for time overflow
-            while (fluxtime>65536)
-            {
-              fprintf(scpfile, "%c%c", 0, 0);
-              fluxtime-=65536;
-            }
+      // Samples since the previous flux, or the start of the rotation
+      fluxtime=(flux_list.edges[edge]+1)-nextsample;
+      nextsample=flux_list.edges[edge]+1;
 
-            // Write sample between fluxes, big-endian
-            fprintf(scpfile, "%c%c", (fluxtime>>8)&0xff, fluxtime&0xff);
+      // Convert samples into nanoseconds/25
+      celltime=(mod_samplestous(fluxtime)*NSINUS)/SCP_BASE_NS;
 
-            // Reset samples counter
-            fluxtime=0;
-          }
-        }
+      // Convert back from float to uint16_t
+      fluxtime=roundf(celltime);
 
-        // Move on to next sample level (bit)
-        c=c<<1;
+      // Check for time overflow
+      while (fluxtime>65536)
+      {
+        fprintf(scpfile, "%c%c", 0, 0);
+        fluxtime-=65536;
       }
+
+      // Write sample between fluxes, big-endian
+      fprintf(scpfile, "%c%c", (fluxtime>>8)&0xff, fluxtime&0xff);
     }
 
     // Store where we are
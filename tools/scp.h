@@ -149,7 +149,7 @@ extern int scp_readheader(FILE *scpfile);
 
 extern void scp_writeheader(FILE *scpfile, const uint8_t rotations, const uint8_t starttrack, const uint8_t endtrack, const float rpm, const uint8_t sides, const int sidetoread);
 
-extern void scp_writetrack(FILE *scpfile, const uint8_t track, const unsigned char *rawtrackdata, const unsigned long rawdatalength, const uint8_t rotations, const float rpm);
+extern void scp_writetrack(FILE *scpfile, const uint8_t track, const unsigned char *rawtrackdata, const unsigned long rawdatalength, const uint8_t rotations, const unsigned long *indexes, const unsigned int indexcount, const float rpm);
 
 extern void scp_finalise(FILE *scpfile, const uint8_t endtrack);
 
@@ -196,7 +196,8 @@ int woz_processtmap(struct woz_chunkheader *chunkheader, FILE *wozfile)
 int woz_readheader(FILE *wozfile)
 {
   long filepos;
-  unsigned char buf;
+  unsigned char buf[WOZ_CRCBLOCKSIZE];
+  size_t buflen;
   uint32_t woz_calccrc=0;
 
   if (wozfile==NULL) return -1;
@@ -219,13 +220,8 @@ int woz_readheader(FILE *wozfile)
   // Check CRC32
   filepos=ftell(wozfile);
 
-  while (!feof(wozfile))
-  {
-    fread(&buf, 1, 1, wozfile);
-
-    if (!feof(wozfile))
-      woz_calccrc=CRC32_CalcStream(woz_calccrc, &buf, 1);
-  }
+  while ((buflen=fread(buf, 1, sizeof(buf), wozfile))>0)
+    woz_calccrc=CRC32_CalcStream(woz_calccrc, buf, buflen);
 
   if (wozheader.crc!=woz_calccrc)
     return -1;
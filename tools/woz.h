@@ -10,6 +10,9 @@
 #define WOZ_TRKS_OFFSET 256
 #define WOZ_BITSBLOCKSIZE 512
 
+// Amount of file read at a time when checking the CRC32
+#define WOZ_CRCBLOCKSIZE 4096
+
 // Chunk ids
 #define WOZ_CHUNK_INFO "INFO"
 #define WOZ_CHUNK_TMAP "TMAP"